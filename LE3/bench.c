@@ -0,0 +1,123 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <threading.h>
+
+/**
+ * Yield ping-pong: two workers and main take turns, so every t_yield() is one
+ * context switch. Prints the average cost of a switch. Then spawns crowds of
+ * workers that each yield a few times, to show that neither creating nor
+ * scheduling them gets slower with their number, and what they cost in
+ * memory. Every crowd runs twice, the second time on pooled stacks.
+ *
+ * Usage: ./bench-ucontext [yields per worker, default 1000000] [crowd sizes, default 10000 100000]
+ *        ./bench-asm      [yields per worker, default 1000000] [crowd sizes, default 10000 100000]
+ */
+
+static int64_t switches = 0;
+
+static void pingpong(int32_t id, int32_t n)
+{
+        (void) id;
+        for(int32_t i = 0; i < n; i++)
+        {
+                switches++;
+                t_yield();
+        }
+        t_finish();
+}
+
+static double elapsed_ns(const struct timespec *start)
+{
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        return (double) (end.tv_sec - start->tv_sec) * 1e9 + (double) (end.tv_nsec - start->tv_nsec);
+}
+
+/**
+ * Virtual and resident size of the process, in KB
+ */
+static void memory_kb(double *virt, double *resident)
+{
+        long  pages[2] = {0, 0};
+        FILE *statm    = fopen("/proc/self/statm", "r");
+        if(statm != NULL)
+        {
+                if(fscanf(statm, "%ld %ld", &pages[0], &pages[1]) != 2)
+                {
+                        pages[0] = pages[1] = 0;
+                }
+                fclose(statm);
+        }
+        *virt     = (double) pages[0] * 4;
+        *resident = (double) pages[1] * 4;
+}
+
+int main(int argc, char **argv)
+{
+        int32_t n = argc > 1 ? (int32_t) atoi(argv[1]) : 1000000;
+
+        t_init();
+        if(t_create(pingpong, 0, n) != 0 || t_create(pingpong, 1, n) != 0)
+        {
+                fprintf(stderr, "Could not spawn worker!\n");
+                return -1;
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do
+        {
+                switches++;
+        } while(t_yield() >= 1);
+        double ns = elapsed_ns(&start);
+#ifdef T_ASM_SWITCH
+        const char *backend = "asm";
+#else
+        const char *backend = "ucontext";
+#endif
+        printf("%-8s %ld switches, %.1f ns per switch\n", backend, (long) switches, ns / (double) switches);
+
+        // each crowd is created all at once, then run to the end, twice over
+        int32_t default_crowds[] = {10000, 100000};
+        int     ncrowds          = argc > 2 ? argc - 2 : 2;
+        for(int c = 0; c < ncrowds; c++)
+        {
+                int32_t crowd = argc > 2 ? (int32_t) atoi(argv[c + 2]) : default_crowds[c];
+                for(int round = 0; round < 2; round++)
+                {
+                        double   virt_before, resident_before, virt, resident;
+                        uint64_t mapped = stack_pool.mapped;
+                        memory_kb(&virt_before, &resident_before);
+                        clock_gettime(CLOCK_MONOTONIC, &start);
+                        for(int32_t i = 0; i < crowd; i++)
+                        {
+                                if(t_create(pingpong, i, 3) != 0)
+                                {
+                                        fprintf(stderr, "Could not spawn worker %d!\n", i);
+                                        return -1;
+                                }
+                        }
+                        double create_ns = elapsed_ns(&start);
+                        switches         = 0;
+                        clock_gettime(CLOCK_MONOTONIC, &start);
+                        for(int32_t i = 0; i < 3; i++)
+                        {
+                                t_yield(); // every worker has run (and touched its stack) after the first
+                        }
+                        memory_kb(&virt, &resident);
+                        while(t_yield() >= 1)
+                                ;
+                        printf("%-8s %6d workers: %7.1f ns per t_create, %6.1f ns per switch, %6lu stacks mapped, "
+                               "%.1f KB resident and %.1f KB virtual per worker%s\n",
+                               backend, crowd, create_ns / crowd, elapsed_ns(&start) / (double) switches,
+                               (unsigned long) (stack_pool.mapped - mapped), (resident - resident_before) / crowd,
+                               (virt - virt_before) / crowd, round == 0 ? "" : " (pooled)");
+                }
+        }
+        printf("%-8s %lu stacks mapped, %lu of them without a guard page, %lu reused from the pool\n", backend,
+               (unsigned long) stack_pool.mapped, (unsigned long) stack_pool.unguarded,
+               (unsigned long) stack_pool.reused);
+        return 0;
+}
@@ -0,0 +1,130 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <threading.h>
+
+/**
+ * One thread, one process: an echo server with a worker per connection, and
+ * as many client workers, each of which sends a message, waits for the echo
+ * and sleeps a while, a few times over. Every read, write, accept and sleep
+ * parks only the worker that makes it, so the clients' sleeps overlap and the
+ * whole run takes about as long as one client's.
+ *
+ * Usage: ./echo-bench [connections, default 2000 (at most the listen backlog)]
+ *                     [round trips each, default 10] [ms of sleep between them, default 10]
+ */
+
+static int32_t rounds   = 10;
+static int32_t sleep_ms = 10;
+static int64_t echoed   = 0;
+static int32_t failures = 0;
+static struct sockaddr_in server;
+
+static void echo_worker(int32_t fd, int32_t unused)
+{
+        (void) unused;
+        char    buf[64];
+        ssize_t n;
+        while((n = t_read(fd, buf, sizeof(buf))) > 0)
+        {
+                if(t_write(fd, buf, (size_t) n) != n)
+                {
+                        break;
+                }
+        }
+        close(fd);
+        t_finish();
+}
+
+static void acceptor(int32_t listen_fd, int32_t connections)
+{
+        for(int32_t i = 0; i < connections; i++)
+        {
+                int fd = t_accept(listen_fd, NULL, NULL);
+                if(fd < 0 || t_create_stack(echo_worker, fd, 0, 16384) != 0)
+                {
+                        perror("accept");
+                        failures++;
+                        continue;
+                }
+        }
+        close(listen_fd);
+        t_finish();
+}
+
+static void client(int32_t id, int32_t unused)
+{
+        (void) unused;
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        // the server's backlog takes the connection before it is accepted
+        if(fd < 0 || connect(fd, (struct sockaddr *) &server, sizeof(server)) != 0)
+        {
+                perror("connect");
+                failures++;
+                t_finish();
+        }
+        for(int32_t i = 0; i < rounds; i++)
+        {
+                int32_t msg[2] = {id, i}, reply[2];
+                if(t_write(fd, msg, sizeof(msg)) != sizeof(msg) || t_read(fd, reply, sizeof(reply)) != sizeof(reply)
+                   || reply[0] != id || reply[1] != i)
+                {
+                        failures++;
+                        break;
+                }
+                echoed++;
+                t_sleep((uint32_t) sleep_ms);
+        }
+        close(fd);
+        t_finish();
+}
+
+int main(int argc, char **argv)
+{
+        int32_t connections = argc > 1 ? (int32_t) atoi(argv[1]) : 2000;
+        rounds              = argc > 2 ? (int32_t) atoi(argv[2]) : rounds;
+        sleep_ms            = argc > 3 ? (int32_t) atoi(argv[3]) : sleep_ms;
+
+        int       listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        socklen_t len       = sizeof(server);
+        server.sin_family      = AF_INET;
+        server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        server.sin_port        = 0; // any free port
+        if(listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &server, sizeof(server)) != 0
+           || listen(listen_fd, connections) != 0 || getsockname(listen_fd, (struct sockaddr *) &server, &len) != 0)
+        {
+                perror("listen");
+                return -1;
+        }
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        t_init();
+        if(t_create(acceptor, listen_fd, connections) != 0)
+        {
+                fprintf(stderr, "Could not spawn worker!\n");
+                return -1;
+        }
+        for(int32_t i = 0; i < connections; i++)
+        {
+                if(t_create_stack(client, i, 0, 16384) != 0)
+                {
+                        fprintf(stderr, "Could not spawn worker!\n");
+                        return -1;
+                }
+        }
+        while(t_yield() >= 1)
+                ; // Wait for the workers to finish their tasks
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double ms = (double) (end.tv_sec - start.tv_sec) * 1e3 + (double) (end.tv_nsec - start.tv_nsec) / 1e6;
+        printf("%d connections x %d round trips with %d ms sleeps: %ld echoed in %.1f ms on one thread "
+               "(%.0f round trips/s, %.0f ms if served one at a time), %d failures\n",
+               connections, rounds, sleep_ms, (long) echoed, ms, (double) echoed / ms * 1e3,
+               (double) connections * rounds * sleep_ms, failures);
+        return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <threading.h>
+
+/**
+ * Scalability of t_run(): a crowd of CPU-bound workers in the style of main.c,
+ * each computing a while and yielding, run on 1, 2, 4, ... kernel threads up
+ * to the number of online CPUs. The workers are all created by one spawner
+ * worker, so they start out on the queue of a single thread and the others
+ * have to steal them. Prints the time of each run, its speedup over one
+ * thread and how many contexts were stolen; every run must compute the same
+ * sum.
+ *
+ * Usage: ./mn-bench [workers, default 64] [steps each, default 100]
+ *                   [iterations per step, default 200000] [max threads, default the CPUs]
+ */
+
+static int32_t  steps;
+static int32_t  work;
+static uint64_t sums[4096];
+
+static void dosomething(int32_t id, int32_t unused)
+{
+        (void) unused;
+        uint64_t x = (uint64_t) id + 1;
+        for(int32_t i = 0; i < steps; i++)
+        {
+                // Perform some computation
+                for(int32_t j = 0; j < work; j++)
+                {
+                        x ^= x << 13;
+                        x ^= x >> 7;
+                        x ^= x << 17;
+                }
+                t_yield(); // Yield the control to other workers
+        }
+        sums[id] = x;
+        t_finish(); // All the work is done!
+}
+
+static void spawner(int32_t workers, int32_t unused)
+{
+        (void) unused;
+        for(int32_t i = 0; i < workers; i++)
+        {
+                if(t_create(dosomething, i, 0) != 0)
+                {
+                        fprintf(stderr, "Could not spawn worker!\n");
+                        exit(-1);
+                }
+        }
+        t_finish();
+}
+
+static double run(uint32_t threads, int32_t workers, uint64_t *sum)
+{
+        struct timespec start, end;
+        uint64_t        stolen = mn_runtime.stolen;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if(t_create(spawner, workers, 0) != 0 || t_run(threads) != 0)
+        {
+                fprintf(stderr, "Could not run workers!\n");
+                exit(-1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        *sum = 0;
+        for(int32_t i = 0; i < workers; i++)
+        {
+                *sum += sums[i];
+        }
+        double ms = (double) (end.tv_sec - start.tv_sec) * 1e3 + (double) (end.tv_nsec - start.tv_nsec) / 1e6;
+        printf("%7u %10.1f", threads, ms);
+        printf(" %10lu", (unsigned long) (mn_runtime.stolen - stolen));
+        return ms;
+}
+
+int main(int argc, char **argv)
+{
+        int32_t  workers = argc > 1 ? (int32_t) atoi(argv[1]) : 64;
+        uint32_t cpus    = (uint32_t) sysconf(_SC_NPROCESSORS_ONLN);
+        steps            = argc > 2 ? (int32_t) atoi(argv[2]) : 100;
+        work             = argc > 3 ? (int32_t) atoi(argv[3]) : 200000;
+        uint32_t max     = argc > 4 ? (uint32_t) atoi(argv[4]) : cpus;
+        if(workers < 1 || workers > (int32_t) (sizeof(sums) / sizeof(sums[0])) || max < 1)
+        {
+                fprintf(stderr, "usage: %s [workers, at most 4096] [steps] [iterations per step] [max threads]\n",
+                        argv[0]);
+                return -1;
+        }
+
+        t_init(); // Initialize the runtime
+        printf("%d workers x %d steps x %d iterations, %u online CPUs\n", workers, steps, work, cpus);
+        printf("%7s %10s %10s %8s\n", "threads", "ms", "stolen", "speedup");
+        uint64_t base_sum = 0, sum = 0;
+        double   base     = run(1, workers, &base_sum);
+        printf(" %8.2f\n", 1.0);
+        for(uint32_t threads = 1; threads < max;)
+        {
+                threads   = threads * 2 < max ? threads * 2 : max;
+                double ms = run(threads, workers, &sum);
+                printf(" %8.2f%s\n", base / ms, sum == base_sum ? "" : "  WRONG SUM");
+                if(sum != base_sum)
+                {
+                        return 1;
+                }
+        }
+        return 0;
+}
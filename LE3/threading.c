@@ -1,21 +1,1090 @@
+#define _GNU_SOURCE // accept4()
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <threading.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * contexts[0] is main, which never finishes. Every other context is a worker
+ * with a stack of its own, or an INVALID one on the free list
+ */
+#define MAIN_CTX 0
+
+/**
+ * While contexts are BLOCKED, t_yield() checks the reactor every this many
+ * calls even if others are ready to run, so they are not starved
+ */
+#define REACTOR_POLL_EVERY 64
+
+/**
+ * A thread with nothing to run or steal tries again this many times, yielding
+ * the CPU in between, before it starts sleeping IDLE_SLEEP_NS between tries
+ */
+#define IDLE_SPINS    64
+#define IDLE_SLEEP_NS 50000
+
+#ifdef T_ASM_SWITCH
+/**
+ * What t_switch() expects to find on a stack it switches to, from the stack
+ * pointer up. A new worker "returns" into t_start() with the stack aligned the
+ * way a call would leave it
+ */
+struct switch_frame
+{
+        uint32_t mxcsr;    // SSE control and status
+        uint32_t fpu_cw;   // x87 control word
+        uint64_t r15;
+        uint64_t r14;
+        uint64_t r13;
+        uint64_t r12;
+        uint64_t rbx;
+        uint64_t rbp;
+        void   (*ret)(void);
+        void    *ret_of_ret; // t_start() never returns, this is never used
+};
+#endif
+
+/**
+ * Stacks are mapped SLAB_BYTES or so at a time, every one with its guard page
+ * below it: [guard|stack][guard|stack]... A slab is one mapping, and each
+ * guard page adds two more by splitting it, so guard pages stop after a
+ * quarter of vm.max_map_count, leaving the rest to the program
+ */
+#define SLAB_BYTES (4u << 20)
+
+struct stack_slab
+{
+        void              *base;
+        size_t             length;
+        struct stack_slab *next;
+};
+
+/**
+ * The pooled stacks of one size, linked through the free_stack at their top,
+ * and the slabs they were carved from
+ */
+struct stack_bucket
+{
+        size_t               size;
+        void                *free;
+        struct stack_slab   *slabs;
+        struct stack_bucket *next;
+};
+
+struct free_stack
+{
+        void   *next;
+        int32_t guarded;
+        int32_t used; // has been handed out before
+};
+
+static struct free_stack *t_free_stack(void *stack, size_t size)
+{
+        return (struct free_stack *) ((char *) stack + size) - 1;
+}
+
+static size_t page_size(void)
+{
+        static size_t size = 0;
+        if(size == 0)
+        {
+                size = (size_t) sysconf(_SC_PAGESIZE);
+        }
+        return size;
+}
+
+/**
+ * How many more stacks may get a guard page
+ */
+static uint64_t *guard_budget(void)
+{
+        static uint64_t budget = 0;
+        static int      known  = 0;
+        if(!known)
+        {
+                uint64_t max_map_count = 65530;
+                FILE    *file          = fopen("/proc/sys/vm/max_map_count", "r");
+                if(file != NULL)
+                {
+                        unsigned long value;
+                        if(fscanf(file, "%lu", &value) == 1)
+                        {
+                                max_map_count = value;
+                        }
+                        fclose(file);
+                }
+                budget = max_map_count / 4;
+                known  = 1;
+        }
+        return &budget;
+}
+
+/**
+ * The bucket for stacks of size bytes, created if there is none yet. NULL
+ * when out of memory
+ */
+static struct stack_bucket *t_bucket(size_t size)
+{
+        for(struct stack_bucket *bucket = stack_pool.buckets; bucket != NULL; bucket = bucket->next)
+        {
+                if(bucket->size == size)
+                {
+                        return bucket;
+                }
+        }
+        struct stack_bucket *bucket = (struct stack_bucket *) calloc(1, sizeof(*bucket));
+        if(bucket != NULL)
+        {
+                bucket->size       = size;
+                bucket->next       = stack_pool.buckets;
+                stack_pool.buckets = bucket;
+        }
+        return bucket;
+}
+
+/**
+ * Maps a slab of stacks into bucket's free list. Returns 0 if successful
+ */
+static int t_map_slab(struct stack_bucket *bucket)
+{
+        size_t stride = bucket->size + page_size();
+        size_t count  = SLAB_BYTES / stride > 0 ? SLAB_BYTES / stride : 1;
+        struct stack_slab *slab = (struct stack_slab *) malloc(sizeof(*slab));
+        if(slab == NULL)
+        {
+                return -1;
+        }
+        // MAP_NORESERVE: only the pages a worker touches cost memory
+        slab->length = count * stride;
+        slab->base   = mmap(NULL, slab->length, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if(slab->base == MAP_FAILED)
+        {
+                free(slab);
+                return -1;
+        }
+        slab->next    = bucket->slabs;
+        bucket->slabs = slab;
+
+        // pushed from the top down, so they are handed out from the bottom up
+        for(size_t i = count; i-- > 0;)
+        {
+                char   *guard   = (char *) slab->base + i * stride;
+                int32_t guarded = 0;
+                if(*guard_budget() > 0 && mprotect(guard, page_size(), PROT_NONE) == 0)
+                {
+                        --*guard_budget();
+                        guarded = 1;
+                }
+                else
+                {
+                        stack_pool.unguarded++;
+                }
+                struct free_stack *link = t_free_stack(guard + page_size(), bucket->size);
+                link->next              = bucket->free;
+                link->guarded           = guarded;
+                link->used              = 0;
+                bucket->free            = guard + page_size();
+        }
+        stack_pool.mapped += count;
+        return 0;
+}
+
+/**
+ * A stack of size bytes (a multiple of the page size) for ctx, from the pool,
+ * which maps another slab when it is empty. NULL when out of memory
+ */
+static void *t_stack_get(struct worker_context *ctx, size_t size)
+{
+        struct stack_bucket *bucket = t_bucket(size);
+        if(bucket == NULL)
+        {
+                return NULL;
+        }
+        if(bucket->free == NULL && t_map_slab(bucket) != 0)
+        {
+                return NULL;
+        }
+        void              *stack = bucket->free;
+        struct free_stack *link  = t_free_stack(stack, size);
+        bucket->free             = link->next;
+        ctx->stack_guarded       = link->guarded;
+        stack_pool.reused += link->used ? 1 : 0;
+        return stack;
+}
+
+/**
+ * Back to the pool: the bucket exists, t_stack_get() made it
+ */
+static void t_stack_put(struct worker_context *ctx)
+{
+        struct stack_bucket *bucket = t_bucket(ctx->stack_size);
+        if(bucket != NULL)
+        {
+                struct free_stack *link = t_free_stack(ctx->stack, ctx->stack_size);
+                link->next              = bucket->free;
+                link->guarded           = ctx->stack_guarded;
+                link->used              = 1;
+                bucket->free            = ctx->stack;
+        }
+        ctx->stack = NULL;
+}
+
+static void t_check_stack(const struct worker_context *ctx)
+{
+        if(ctx->stack != NULL && !ctx->stack_guarded && *(const uint64_t *) ctx->stack != STK_CANARY)
+        {
+                fprintf(stderr, "libthreading: worker %u overflowed its %zu byte stack\n", ctx->idx, ctx->stack_size);
+                abort();
+        }
+}
+
+/**
+ * The context that called t_finish(). Its stack cannot be freed until we are
+ * off it, so the next context to run does that
+ */
+static struct worker_context *zombie = NULL;
+
+static void queue_push(struct context_queue *queue, struct worker_context *ctx)
+{
+        ctx->next = NULL;
+        if(queue->tail != NULL)
+        {
+                queue->tail->next = ctx;
+        }
+        else
+        {
+                queue->head = ctx;
+        }
+        queue->tail = ctx;
+}
+
+static struct worker_context *queue_pop(struct context_queue *queue)
+{
+        struct worker_context *ctx = queue->head;
+        if(ctx != NULL)
+        {
+                queue->head = ctx->next;
+                if(queue->head == NULL)
+                {
+                        queue->tail = NULL;
+                }
+                ctx->next = NULL;
+        }
+        return ctx;
+}
+
+/**
+ * One per kernel thread in t_run(). home is the context of the thread itself,
+ * which runs t_loop() on the thread's own stack (main's, on the thread that
+ * called t_run()); it is never queued, so it only ever runs there. A context
+ * that yields or finishes cannot be queued or freed until we are off its
+ * stack, so the next context to run on the thread does that, as with zombie
+ */
+struct scheduler
+{
+        pthread_mutex_t        lock;    // guards queue, thieves take from it too
+        struct context_queue   queue;
+        uint32_t               length;  // of queue, read without the lock to skip empty ones
+        uint32_t               seed;    // where the next steal looks first
+        uint64_t               stolen;
+        struct worker_context *home;
+        struct worker_context *current;
+        struct worker_context *zombie;  // finished here
+        struct worker_context *requeue; // yielded here
+        struct worker_context  thread_ctx; // home of the threads t_run() starts
+        pthread_t              thread;
+};
+
+/**
+ * The scheduler of the calling kernel thread, NULL outside t_run()
+ */
+static __thread struct scheduler *here = NULL;
+
+/**
+ * A worker can resume on another thread than it left, so here is read anew
+ * after every switch. noipa keeps the compiler from reusing its address, or
+ * the result of an earlier call, from before one
+ */
+static __attribute__((noipa)) struct scheduler *t_here(void)
+{
+        return here;
+}
+
+static struct worker_context *t_current(void)
+{
+        struct scheduler *sched = t_here();
+        return sched != NULL ? sched->current : contexts[current_context_idx];
+}
+
+/**
+ * Guards the context table, the free list and the stack pool while t_run()
+ * has several threads at them
+ */
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void t_lock(void)
+{
+        if(t_here() != NULL)
+        {
+                pthread_mutex_lock(&table_lock);
+        }
+}
+
+static void t_unlock(void)
+{
+        if(t_here() != NULL)
+        {
+                pthread_mutex_unlock(&table_lock);
+        }
+}
+
+static void t_enqueue(struct scheduler *sched, struct worker_context *ctx)
+{
+        pthread_mutex_lock(&sched->lock);
+        queue_push(&sched->queue, ctx);
+        __atomic_store_n(&sched->length, sched->length + 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&sched->lock);
+}
+
+/**
+ * Takes up to half of victim's queue, at least one context: the first is
+ * returned, the others moved to sched's queue. NULL if it was empty
+ */
+static struct worker_context *t_take(struct scheduler *sched, struct scheduler *victim)
+{
+        if(__atomic_load_n(&victim->length, __ATOMIC_RELAXED) == 0)
+        {
+                return NULL;
+        }
+        struct context_queue batch = {NULL, NULL};
+        uint32_t             taken = 0;
+        pthread_mutex_lock(&victim->lock);
+        uint32_t want = victim == sched ? 1 : (victim->length + 1) / 2;
+        for(; taken < want && victim->queue.head != NULL; taken++)
+        {
+                queue_push(&batch, queue_pop(&victim->queue));
+        }
+        __atomic_store_n(&victim->length, victim->length - taken, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&victim->lock);
+
+        struct worker_context *first = queue_pop(&batch);
+        if(batch.head != NULL)
+        {
+                pthread_mutex_lock(&sched->lock);
+                for(struct worker_context *ctx = queue_pop(&batch); ctx != NULL; ctx = queue_pop(&batch))
+                {
+                        queue_push(&sched->queue, ctx);
+                }
+                __atomic_store_n(&sched->length, sched->length + taken - 1, __ATOMIC_RELAXED);
+                pthread_mutex_unlock(&sched->lock);
+        }
+        if(victim != sched)
+        {
+                sched->stolen += taken;
+        }
+        return first;
+}
+
+/**
+ * The next context for sched to run: the front of its own queue, otherwise
+ * stolen from another thread's. A yielding worker only looks at one other
+ * queue, t_loop() at all of them. NULL if there was none
+ */
+static struct worker_context *t_next(struct scheduler *sched, uint32_t victims)
+{
+        struct worker_context *ctx = t_take(sched, sched);
+        for(uint32_t i = 0; ctx == NULL && i < victims && mn_runtime.num_threads > 1; i++)
+        {
+                uint32_t victim = sched->seed++ % mn_runtime.num_threads;
+                if(&mn_runtime.schedulers[victim] != sched)
+                {
+                        ctx = t_take(sched, &mn_runtime.schedulers[victim]);
+                }
+        }
+        return ctx;
+}
+
+/**
+ * Returns the stack of the worker that finished last, if any, to the pool and
+ * puts its context on the free list. Under t_run(), also queues the context
+ * that yielded to the caller
+ */
+static void t_reap(void)
+{
+        struct scheduler      *sched = t_here();
+        struct worker_context *dead  = zombie;
+        if(sched != NULL)
+        {
+                if(sched->requeue != NULL)
+                {
+                        t_enqueue(sched, sched->requeue);
+                        sched->requeue = NULL;
+                }
+                dead          = sched->zombie;
+                sched->zombie = NULL;
+        }
+        else
+        {
+                zombie = NULL;
+        }
+        if(dead != NULL)
+        {
+                t_lock();
+                t_stack_put(dead);
+                dead->state = INVALID;
+                queue_push(&free_list, dead);
+                t_unlock();
+        }
+}
+
+/**
+ * Where every worker starts: runs its function, then finishes it in case the
+ * function returned without calling t_finish()
+ */
+static void t_start(void)
+{
+        t_reap();
+        struct worker_context *self = t_current();
+        self->entry(self->arg1, self->arg2);
+        t_finish();
+}
+
+static void t_switch_to(struct worker_context *next)
+{
+        struct scheduler      *sched = t_here();
+        struct worker_context *from  = t_current();
+        t_check_stack(from);
+        if(sched != NULL)
+        {
+                sched->current = next;
+        }
+        else
+        {
+                current_context_idx = next->idx;
+        }
+#ifdef T_ASM_SWITCH
+        t_switch(&from->sp, next->sp);
+#else
+        swapcontext(&from->context, &next->context);
+#endif
+        t_reap();
+}
+
+/**
+ * Sets ctx up so that switching to it starts t_start() on its stack. A
+ * function of its own so that getcontext(), which returns twice as far as the
+ * compiler knows, does not make it keep everything in t_create() in memory
+ */
+static __attribute__((noinline)) int t_prepare(struct worker_context *ctx)
+{
+#ifdef T_ASM_SWITCH
+        uintptr_t top = ((uintptr_t) ctx->stack + ctx->stack_size) & ~(uintptr_t) 15;
+        struct switch_frame *frame =
+                (struct switch_frame *) (top - sizeof(struct switch_frame));
+        memset(frame, 0, sizeof(*frame));
+        frame->mxcsr  = 0x1f80; // the defaults the ABI starts a process with
+        frame->fpu_cw = 0x037f;
+        frame->ret    = t_start;
+        ctx->sp       = frame;
+#else
+        if(getcontext(&ctx->context) != 0)
+        {
+                return -1;
+        }
+        ctx->context.uc_stack.ss_sp   = ctx->stack;
+        ctx->context.uc_stack.ss_size = ctx->stack_size;
+        ctx->context.uc_link          = NULL;
+        makecontext(&ctx->context, t_start, 0);
+#endif
+        return 0;
+}
+
+/**
+ * An INVALID context, from the free list if there is one, otherwise a new one
+ * added to the table. NULL when out of memory
+ */
+static struct worker_context *t_new_context(void)
+{
+        struct worker_context *ctx = queue_pop(&free_list);
+        if(ctx != NULL)
+        {
+                return ctx;
+        }
+        if(num_contexts == table_size)
+        {
+                if(table_size > UINT32_MAX / 2)
+                {
+                        return NULL;
+                }
+                uint32_t size = table_size > 0 ? 2 * table_size : NUM_CTX;
+                struct worker_context **table =
+                        (struct worker_context **) realloc(contexts, size * sizeof(*table));
+                if(table == NULL)
+                {
+                        return NULL;
+                }
+                contexts   = table;
+                table_size = size;
+        }
+        ctx = (struct worker_context *) calloc(1, sizeof(*ctx));
+        if(ctx == NULL)
+        {
+                return NULL;
+        }
+        ctx->idx                 = num_contexts;
+        contexts[num_contexts++] = ctx;
+        return ctx;
+}
+
+static int64_t now_ns(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void heap_swap(uint32_t i, uint32_t j)
+{
+        struct sleeper tmp  = reactor.sleepers[i];
+        reactor.sleepers[i] = reactor.sleepers[j];
+        reactor.sleepers[j] = tmp;
+}
+
+static int heap_push(int64_t wake_at, struct worker_context *ctx)
+{
+        if(reactor.num_sleepers == reactor.heap_size)
+        {
+                uint32_t        size     = reactor.heap_size > 0 ? 2 * reactor.heap_size : NUM_CTX;
+                struct sleeper *sleepers = (struct sleeper *) realloc(reactor.sleepers, size * sizeof(*sleepers));
+                if(sleepers == NULL)
+                {
+                        return -1;
+                }
+                reactor.sleepers  = sleepers;
+                reactor.heap_size = size;
+        }
+        uint32_t i          = reactor.num_sleepers++;
+        reactor.sleepers[i] = (struct sleeper){wake_at, ctx};
+        while(i > 0 && reactor.sleepers[(i - 1) / 2].wake_at > reactor.sleepers[i].wake_at)
+        {
+                heap_swap(i, (i - 1) / 2);
+                i = (i - 1) / 2;
+        }
+        return 0;
+}
+
+static struct worker_context *heap_pop(void)
+{
+        struct worker_context *ctx = reactor.sleepers[0].ctx;
+        reactor.sleepers[0]        = reactor.sleepers[--reactor.num_sleepers];
+        uint32_t i                 = 0;
+        while(1)
+        {
+                uint32_t smallest = i;
+                uint32_t left     = 2 * i + 1;
+                uint32_t right    = 2 * i + 2;
+                if(left < reactor.num_sleepers && reactor.sleepers[left].wake_at < reactor.sleepers[smallest].wake_at)
+                {
+                        smallest = left;
+                }
+                if(right < reactor.num_sleepers && reactor.sleepers[right].wake_at < reactor.sleepers[smallest].wake_at)
+                {
+                        smallest = right;
+                }
+                if(smallest == i)
+                {
+                        return ctx;
+                }
+                heap_swap(i, smallest);
+                i = smallest;
+        }
+}
+
+static void t_unblock(struct worker_context *ctx)
+{
+        ctx->state = VALID;
+        reactor.num_blocked--;
+        num_valid++;
+        queue_push(&ready_queue, ctx);
+}
+
+/**
+ * Moves the contexts whose fd is ready or whose sleep is over to the ready
+ * queue. With wait set, keeps waiting until there is at least one
+ */
+static void t_poll(int wait)
+{
+        struct epoll_event events[64];
+        do
+        {
+                int timeout = 0;
+                if(wait)
+                {
+                        timeout = -1;
+                        if(reactor.num_sleepers > 0)
+                        {
+                                int64_t ns = reactor.sleepers[0].wake_at - now_ns();
+                                timeout    = ns > 0 ? (int) ((ns + 999999) / 1000000) : 0;
+                        }
+                }
+                int n = 0;
+                if(reactor.epoll_fd >= 0)
+                {
+                        n = epoll_wait(reactor.epoll_fd, events, 64, timeout);
+                }
+                else if(timeout > 0)
+                {
+                        struct timespec pause = {timeout / 1000, (long) (timeout % 1000) * 1000000};
+                        nanosleep(&pause, NULL);
+                }
+                for(int i = 0; i < n; i++)
+                {
+                        t_unblock((struct worker_context *) events[i].data.ptr);
+                }
+                int64_t now = now_ns();
+                while(reactor.num_sleepers > 0 && reactor.sleepers[0].wake_at <= now)
+                {
+                        t_unblock(heap_pop());
+                }
+        } while(wait && ready_queue.head == NULL);
+        reactor.yields = 0;
+}
+
+/**
+ * Switches to the next context that is ready to run, waiting for the reactor
+ * if there is none. That may be the caller itself, if it was BLOCKED
+ */
+static void t_schedule(void)
+{
+        if(ready_queue.head == NULL)
+        {
+                t_poll(1);
+        }
+        struct worker_context *next = queue_pop(&ready_queue);
+        if(next != contexts[current_context_idx])
+        {
+                t_switch_to(next);
+        }
+}
+
+/**
+ * BLOCKED until the reactor moves the caller back to the ready queue
+ */
+static void t_park(void)
+{
+        contexts[current_context_idx]->state = BLOCKED;
+        num_valid--;
+        reactor.num_blocked++;
+        t_schedule();
+}
+
+/**
+ * Parks the caller until fd has one of events. -1 with errno set if fd cannot
+ * be waited on
+ */
+static int t_wait_fd(int fd, uint32_t events)
+{
+        if(t_here() != NULL)
+        {
+                errno = ENOTSUP; // under t_run()
+                return -1;
+        }
+        if(reactor.epoll_fd < 0)
+        {
+                reactor.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+                if(reactor.epoll_fd < 0)
+                {
+                        return -1;
+                }
+        }
+        // one shot: after firing it stays registered but disabled until the next wait
+        struct epoll_event event;
+        event.events   = events | EPOLLONESHOT;
+        event.data.ptr = contexts[current_context_idx];
+        if(epoll_ctl(reactor.epoll_fd, EPOLL_CTL_MOD, fd, &event) != 0
+           && (errno != ENOENT || epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0))
+        {
+                return -1;
+        }
+        t_park();
+        return 0;
+}
+
+static int t_set_nonblocking(int fd)
+{
+        int flags = fcntl(fd, F_GETFL);
+        if(flags < 0)
+        {
+                return -1;
+        }
+        return (flags & O_NONBLOCK) ? 0 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+ssize_t t_read(int fd, void *buf, size_t count)
+{
+        if(t_set_nonblocking(fd) != 0)
+        {
+                return -1;
+        }
+        while(1)
+        {
+                ssize_t n = read(fd, buf, count);
+                if(n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                {
+                        return n;
+                }
+                if(errno != EINTR && t_wait_fd(fd, EPOLLIN | EPOLLRDHUP) != 0)
+                {
+                        return -1;
+                }
+        }
+}
+
+ssize_t t_write(int fd, const void *buf, size_t count)
+{
+        if(t_set_nonblocking(fd) != 0)
+        {
+                return -1;
+        }
+        while(1)
+        {
+                ssize_t n = write(fd, buf, count);
+                if(n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                {
+                        return n;
+                }
+                if(errno != EINTR && t_wait_fd(fd, EPOLLOUT) != 0)
+                {
+                        return -1;
+                }
+        }
+}
+
+int t_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+        if(t_set_nonblocking(fd) != 0)
+        {
+                return -1;
+        }
+        while(1)
+        {
+                int conn = accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if(conn >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                {
+                        return conn;
+                }
+                if(errno != EINTR && t_wait_fd(fd, EPOLLIN) != 0)
+                {
+                        return -1;
+                }
+        }
+}
+
+int32_t t_sleep(uint32_t ms)
+{
+        if(t_here() != NULL)
+        {
+                errno = ENOTSUP;
+                return -1;
+        }
+        if(contexts == NULL)
+        {
+                return -1;
+        }
+        if(heap_push(now_ns() + (int64_t) ms * 1000000, contexts[current_context_idx]) != 0)
+        {
+                return -1;
+        }
+        t_park();
+        return 0;
+}
+
+/**
+ * Gives back everything at exit. If exit() is called from a worker, the slab
+ * holding that worker's stack is left alone, we are running on it
+ */
+static void t_release(void)
+{
+        if(mn_runtime.schedulers != NULL)
+        {
+                return; // exit() from inside t_run(), the other threads still use it all
+        }
+        char *running = contexts != NULL ? (char *) contexts[current_context_idx]->stack : NULL;
+        for(uint32_t i = 0; i < num_contexts; i++)
+        {
+                free(contexts[i]);
+        }
+        free(contexts);
+        while(stack_pool.buckets != NULL)
+        {
+                struct stack_bucket *bucket = stack_pool.buckets;
+                while(bucket->slabs != NULL)
+                {
+                        struct stack_slab *slab = bucket->slabs;
+                        char              *base = (char *) slab->base;
+                        if(running == NULL || running < base || running >= base + slab->length)
+                        {
+                                munmap(slab->base, slab->length);
+                        }
+                        bucket->slabs = slab->next;
+                        free(slab);
+                }
+                stack_pool.buckets = bucket->next;
+                free(bucket);
+        }
+        memset(&stack_pool, 0, sizeof(stack_pool));
+        contexts     = NULL;
+        num_contexts = 0;
+        table_size   = 0;
+        num_valid    = 0;
+        zombie       = NULL;
+        memset(&ready_queue, 0, sizeof(ready_queue));
+        memset(&free_list, 0, sizeof(free_list));
+        if(reactor.epoll_fd >= 0)
+        {
+                close(reactor.epoll_fd);
+        }
+        free(reactor.sleepers);
+        memset(&reactor, 0, sizeof(reactor));
+        reactor.epoll_fd = -1;
+}
 
 void t_init()
 {
-        // TODO
+        static int registered = 0;
+        if(!registered)
+        {
+                atexit(t_release);
+                registered = 1;
+        }
+        if(contexts != NULL)
+        {
+                return;
+        }
+        struct worker_context *main_ctx = t_new_context();
+        if(main_ctx == NULL)
+        {
+                return; // t_create() fails from here on
+        }
+        main_ctx->state     = VALID;
+        num_valid           = 1;
+        current_context_idx = MAIN_CTX;
 }
 
 int32_t t_create(fptr foo, int32_t arg1, int32_t arg2)
 {
-        // TODO
+        return t_create_stack(foo, arg1, arg2, STK_SZ);
+}
+
+int32_t t_create_stack(fptr foo, int32_t arg1, int32_t arg2, size_t stack_size)
+{
+        stack_size = (stack_size + page_size() - 1) & ~(page_size() - 1);
+        if(stack_size == 0)
+        {
+                stack_size = page_size();
+        }
+        t_lock();
+        struct worker_context *ctx = contexts != NULL ? t_new_context() : NULL;
+        if(ctx != NULL)
+        {
+                ctx->stack = t_stack_get(ctx, stack_size);
+                if(ctx->stack == NULL)
+                {
+                        queue_push(&free_list, ctx);
+                        ctx = NULL;
+                }
+        }
+        t_unlock();
+        if(ctx == NULL)
+        {
+                return 1;
+        }
+        ctx->stack_size = stack_size;
+        if(!ctx->stack_guarded)
+        {
+                *(uint64_t *) ctx->stack = STK_CANARY;
+        }
+        ctx->entry = foo;
+        ctx->arg1  = arg1;
+        ctx->arg2  = arg2;
+        if(t_prepare(ctx) != 0)
+        {
+                t_lock();
+                t_stack_put(ctx);
+                queue_push(&free_list, ctx);
+                t_unlock();
+                return 1;
+        }
+        ctx->state              = VALID;
+        struct scheduler *sched = t_here();
+        if(sched != NULL)
+        {
+                // counted before anyone can steal it and finish it
+                __atomic_add_fetch(&mn_runtime.num_live, 1, __ATOMIC_RELAXED);
+                t_enqueue(sched, ctx);
+                return 0;
+        }
+        num_valid++;
+        queue_push(&ready_queue, ctx);
+        return 0;
 }
 
 int32_t t_yield()
 {
-        // TODO
+        struct scheduler *sched = t_here();
+        if(sched != NULL)
+        {
+                struct worker_context *next = t_next(sched, 1);
+                if(next != NULL)
+                {
+                        sched->requeue = sched->current;
+                        t_switch_to(next);
+                }
+                // the live workers but the caller, and main, waiting in t_run()
+                return (int32_t) __atomic_load_n(&mn_runtime.num_live, __ATOMIC_RELAXED);
+        }
+        if(contexts == NULL)
+        {
+                return -1;
+        }
+        if(reactor.num_blocked > 0 && (ready_queue.head == NULL || ++reactor.yields >= REACTOR_POLL_EVERY))
+        {
+                t_poll(ready_queue.head == NULL); // nothing else can run: wait for what can
+        }
+        struct worker_context *next = queue_pop(&ready_queue);
+        if(next != NULL)
+        {
+                queue_push(&ready_queue, contexts[current_context_idx]);
+                t_switch_to(next);
+        }
+        return (int32_t) (num_valid + reactor.num_blocked - 1);
 }
 
 void t_finish()
 {
-        // TODO
+        struct scheduler *sched = t_here();
+        if(sched != NULL)
+        {
+                struct worker_context *self = sched->current;
+                self->state                 = DONE;
+                sched->zombie               = self;
+                __atomic_sub_fetch(&mn_runtime.num_live, 1, __ATOMIC_RELEASE);
+                struct worker_context *next = t_next(sched, 1);
+                t_switch_to(next != NULL ? next : sched->home);
+                abort(); // nothing switches back to a finished worker
+        }
+        struct worker_context *self = contexts[current_context_idx];
+        self->state                 = DONE;
+        num_valid--;
+        zombie = self; // freed by whoever runs next, we are still on its stack
+        if(ready_queue.head != NULL || reactor.num_blocked > 0)
+        {
+                t_schedule();
+        }
+        abort(); // main never finishes, so there was somewhere to go
+}
+
+/**
+ * What the home context of every thread does under t_run(): runs whatever it
+ * can get, until no worker is left
+ */
+static void t_loop(void)
+{
+        uint32_t idle = 0;
+        while(__atomic_load_n(&mn_runtime.num_live, __ATOMIC_ACQUIRE) > 0)
+        {
+                struct scheduler      *sched = t_here();
+                struct worker_context *next  = t_next(sched, mn_runtime.num_threads);
+                if(next != NULL)
+                {
+                        idle = 0;
+                        t_switch_to(next); // back when a worker finishes here with nothing left to run
+                }
+                else if(++idle < IDLE_SPINS)
+                {
+                        sched_yield();
+                }
+                else
+                {
+                        struct timespec pause = {0, IDLE_SLEEP_NS};
+                        nanosleep(&pause, NULL);
+                }
+        }
+}
+
+static void *t_thread(void *arg)
+{
+        here          = (struct scheduler *) arg;
+        here->current = here->home;
+        t_loop();
+        here = NULL;
+        return NULL;
+}
+
+int32_t t_run(uint32_t threads)
+{
+        if(contexts == NULL || t_here() != NULL || current_context_idx != MAIN_CTX || reactor.num_blocked > 0)
+        {
+                return -1;
+        }
+        if(threads == 0)
+        {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                threads   = cpus > 0 ? (uint32_t) cpus : 1;
+        }
+        struct scheduler *scheds = (struct scheduler *) calloc(threads, sizeof(*scheds));
+        if(scheds == NULL)
+        {
+                return -1;
+        }
+        page_size(); // set once here rather than raced for by the threads
+        guard_budget();
+
+        mn_runtime.schedulers  = scheds;
+        mn_runtime.num_threads = threads;
+        mn_runtime.num_live    = num_valid - 1;
+        for(uint32_t i = 0; i < threads; i++)
+        {
+                pthread_mutex_init(&scheds[i].lock, NULL);
+                scheds[i].seed = i + 1;
+                scheds[i].home = i == 0 ? contexts[MAIN_CTX] : &scheds[i].thread_ctx;
+        }
+        // dealt out round robin, and stolen back by whichever thread runs dry
+        for(uint32_t i = 0; ready_queue.head != NULL; i++)
+        {
+                queue_push(&scheds[i % threads].queue, queue_pop(&ready_queue));
+                scheds[i % threads].length++;
+        }
+        num_valid = 1;
+
+        // a thread that fails to start leaves its queue to be stolen
+        uint32_t started = 1;
+        while(started < threads && pthread_create(&scheds[started].thread, NULL, t_thread, &scheds[started]) == 0)
+        {
+                started++;
+        }
+        here          = &scheds[0];
+        here->current = here->home;
+        t_loop();
+        here = NULL;
+
+        for(uint32_t i = 1; i < started; i++)
+        {
+                pthread_join(scheds[i].thread, NULL);
+        }
+        for(uint32_t i = 0; i < threads; i++)
+        {
+                mn_runtime.stolen += scheds[i].stolen;
+                pthread_mutex_destroy(&scheds[i].lock);
+        }
+        mn_runtime.schedulers  = NULL;
+        mn_runtime.num_threads = 0;
+        free(scheds);
+        return 0;
 }
@@ -1,13 +1,17 @@
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 #include <ucontext.h>
 
 #ifndef COOPERATIVE_MULTITASKING
 #define COOPERATIVE_MULTITASKING
 
-#define STK_SZ  4096
-#define NUM_CTX 16
+#define STK_SZ     65536 // stack size of t_create(), t_create_stack() picks its own
+#define NUM_CTX    16    // initial size of the context table, it doubles when full
+#define STK_CANARY 0x5ca1ab1e0ddba11ULL
 
 /**
  * This enum describes the various states an instance of stored context can be
@@ -18,6 +22,7 @@ enum context_state
         INVALID = 0, // The context entry is invalid
         VALID   = 1, // The context entry is valid and ready to be used
         DONE    = 2, // This context has completed its work
+        BLOCKED = 3, // The context waits for an fd or a timer in the reactor
 };
 
 /**
@@ -36,14 +41,135 @@ struct worker_context
          * The actual context
          */
         ucontext_t context;
+
+        /**
+         * With the assembly switch (make SWITCH=asm) the context is only the
+         * stack pointer: t_switch() pushes the callee-saved registers on the
+         * stack it leaves and pops them off the one it enters. Unused with
+         * ucontext_t
+         */
+        void *sp;
+
+        /**
+         * The stack the worker runs on (NULL for the context of main), its
+         * size, and the function it starts in, called as entry(arg1, arg2)
+         */
+        void   *stack;
+        size_t  stack_size;
+        int32_t stack_guarded;
+        void  (*entry)(int32_t, int32_t);
+        int32_t arg1;
+        int32_t arg2;
+
+        /**
+         * Position in the context table, and the link in whichever list the
+         * context is on: the ready queue while VALID and waiting to run, the
+         * free list while INVALID
+         */
+        uint32_t               idx;
+        struct worker_context *next;
 };
 
 /**
- * The list of contexts and the index to the current context. Note that these
- * are declared in threading_data.c
+ * A FIFO of contexts linked through their next pointers, so adding and
+ * removing one is O(1) and needs no memory
+ */
+struct context_queue
+{
+        struct worker_context *head;
+        struct worker_context *tail;
+};
+
+/**
+ * Stacks are mmap'd with a PROT_NONE guard page right below them, so running
+ * off the end faults instead of overwriting whatever is next. Every guard page
+ * costs the process a memory mapping, and there are only vm.max_map_count of
+ * those (65530 by default); once the kernel refuses, stacks come without one.
+ * The lowest word of such a stack holds STK_CANARY instead, checked whenever
+ * the worker is switched away from. (Guarded stacks leave that page alone, so
+ * it never becomes resident.)
+ *
+ * The stacks of finished workers are kept, by size, for the next t_create():
+ * once the pool holds as many as are needed at once, creating and finishing
+ * workers makes no system calls. They are only unmapped at exit
+ */
+struct stack_bucket;
+
+struct stack_pool
+{
+        struct stack_bucket *buckets;
+        uint64_t             mapped;    // stacks mmap'd so far
+        uint64_t             unguarded; // of those, the ones without a guard page
+        uint64_t             reused;    // stacks handed out again from the pool
+};
+
+extern struct stack_pool stack_pool;
+
+/**
+ * A context in t_sleep() and when it is due, in CLOCK_MONOTONIC nanoseconds
+ */
+struct sleeper
+{
+        int64_t                wake_at;
+        struct worker_context *ctx;
+};
+
+/**
+ * Contexts waiting in t_read(), t_write(), t_accept() or t_sleep() are
+ * BLOCKED: off the ready queue, registered with epoll or in the sleeper heap.
+ * The reactor is polled (without waiting) every so many t_yield()s while any
+ * context is BLOCKED, and waited on when no context is ready to run
+ */
+struct reactor
+{
+        int             epoll_fd;     // -1 until something first waits on an fd
+        struct sleeper *sleepers;     // a min-heap on wake_at
+        uint32_t        num_sleepers;
+        uint32_t        heap_size;
+        uint32_t        num_blocked;  // contexts BLOCKED on an fd or in t_sleep()
+        uint32_t        yields;       // since the last poll
+};
+
+extern struct reactor reactor;
+
+/**
+ * t_run() runs the workers on several kernel threads (M:N). Each thread has a
+ * scheduler of its own: the context it runs, and a ready queue that the
+ * workers it runs yield to and create on. A thread whose queue is empty steals
+ * half of another's, so workers migrate to where there is a core for them.
+ * The scheduler is defined in threading.c; the context table, free list and
+ * stack pool are shared and guarded by one lock
  */
-extern struct worker_context contexts[NUM_CTX];
-extern uint8_t               current_context_idx;
+struct scheduler;
+
+struct mn_runtime
+{
+        struct scheduler *schedulers;  // one per kernel thread, NULL outside t_run()
+        uint32_t          num_threads;
+        uint32_t          num_live;    // workers not finished yet, updated atomically
+        uint64_t          stolen;      // contexts moved between threads, over all runs
+};
+
+extern struct mn_runtime mn_runtime;
+
+/**
+ * The table of contexts and the index to the current context. Note that these
+ * are declared in threading_data.c. The table holds pointers, so a context
+ * never moves once created (a ucontext_t points into itself); num_contexts of
+ * them exist, of table_size slots
+ */
+extern struct worker_context **contexts;
+extern uint32_t                num_contexts;
+extern uint32_t                table_size;
+extern uint32_t                current_context_idx;
+
+/**
+ * The VALID contexts other than the current one, in the order they run next,
+ * the INVALID ones ready for reuse, and how many contexts are VALID
+ */
+extern struct context_queue ready_queue;
+extern struct context_queue free_list;
+extern uint32_t             num_valid;
 
 typedef void (*fptr)(int32_t, int32_t);
 typedef void (*ctx_ptr)(void);
@@ -66,13 +192,21 @@ void t_init();
  */
 int32_t t_create(fptr foo, int32_t arg1, int32_t arg2);
 
+/**
+ * Like t_create(), with a stack of stack_size bytes (rounded up to whole pages)
+ * instead of STK_SZ
+ *
+ * returns: 0 if successful, 1 otherwise
+ */
+int32_t t_create_stack(fptr foo, int32_t arg1, int32_t arg2, size_t stack_size);
+
 /**
  * This function cooperatively yields the control over to other workers. This
  * function may or may not return in the caller
  *
  * returns: This function returns the number of contexts (apart from the
- *          caller) which are in the VALID state if it is successful, otherwise
- *          it returns -1
+ *          caller) which are in the VALID or BLOCKED state if it is
+ *          successful, otherwise it returns -1
  */
 int32_t t_yield();
 
@@ -83,4 +217,50 @@ int32_t t_yield();
  */
 void t_finish();
 
+/**
+ * Runs the workers created so far, and the ones they create, on threads kernel
+ * threads (one per online CPU if 0) until all of them have finished, then
+ * returns in main. The calling thread is one of them. Instead of
+ * while(t_yield() >= 1);
+ *
+ * A worker may resume on another thread than the one it yielded on, so it
+ * must not keep thread-local data, or its address, across t_yield() (errno
+ * included). t_read(), t_write(), t_accept() and t_sleep() fail with ENOTSUP
+ * where they would have to wait: the reactor only runs on one thread
+ *
+ * returns: 0 if successful, -1 if not called from main or if a worker is
+ *          BLOCKED
+ */
+int32_t t_run(uint32_t threads);
+
+/**
+ * read(2), write(2) and accept(2) for workers: fd is switched to non-blocking
+ * mode, and where the call would block, the worker is parked in the reactor
+ * and the others run until fd is ready. Only one worker may wait on an fd at a
+ * time. t_write() returns after one successful write(2), which may be short.
+ * t_accept() returns the connection in non-blocking mode already
+ *
+ * returns: what the system call returns, -1 with errno set on an error
+ */
+ssize_t t_read(int fd, void *buf, size_t count);
+ssize_t t_write(int fd, const void *buf, size_t count);
+int     t_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/**
+ * Parks the calling worker for at least ms milliseconds while the others run
+ *
+ * returns: 0 if successful, -1 otherwise
+ */
+int32_t t_sleep(uint32_t ms);
+
+#ifdef T_ASM_SWITCH
+/**
+ * Saves the callee-saved registers of the caller on its stack, stores the
+ * stack pointer in *save_sp, then switches to the stack load_sp and returns
+ * into whatever saved it there. Unlike swapcontext() it leaves the signal
+ * mask alone, so a switch makes no system call. Implemented in switch.S
+ */
+void t_switch(void **save_sp, void *load_sp);
+#endif
+
 #endif
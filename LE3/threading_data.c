@@ -1,11 +1,23 @@
 #include <threading.h>
 
 /**
- * This vector holds all the stored contexts
+ * This table holds all the stored contexts
  */
-struct worker_context contexts[NUM_CTX];
+struct worker_context **contexts     = NULL;
+uint32_t                num_contexts = 0;
+uint32_t                table_size   = 0;
 
 /**
  * The index to the current context
  */
-uint8_t current_context_idx = NUM_CTX; // Initialize to garbage
+uint32_t current_context_idx = 0;
+
+struct context_queue ready_queue = {NULL, NULL};
+struct context_queue free_list   = {NULL, NULL};
+uint32_t             num_valid   = 0;
+
+struct stack_pool stack_pool = {NULL, 0, 0, 0};
+
+struct reactor reactor = {-1, NULL, 0, 0, 0, 0};
+
+struct mn_runtime mn_runtime = {NULL, 0, 0, 0};
@@ -0,0 +1,69 @@
+#ifndef _BoundedBuffer_H_
+#define _BoundedBuffer_H_
+
+#include <semaphore.h>
+#include <thread>
+
+#include "ring.h"
+
+
+/* Blocking FIFO queue of at most capacity items, connecting the stages of the
+ client's pipeline. A full buffer holds up the stage in front of it, so a slow
+ stage slows down the ones feeding it instead of letting the queue grow.
+ The items live in a lock-free MPMCRing; the two semaphores only count free
+ and used slots, so a push or pop that does not have to wait takes no lock and
+ makes no system call. */
+template <class T>
+class BoundedBuffer {
+private:
+	MPMCRing<T> ring;
+	sem_t free_slots;
+	sem_t used_slots;
+
+public:
+	BoundedBuffer (size_t _capacity);
+	~BoundedBuffer ();
+
+	void push (const T& item);
+	/* Blocks while the buffer is full. */
+
+	T pop ();
+	/* Blocks while the buffer is empty, then takes the oldest item. */
+};
+
+
+template <class T>
+BoundedBuffer<T>::BoundedBuffer (size_t _capacity) : ring(_capacity) {
+	sem_init(&free_slots, 0, _capacity > 0 ? _capacity : 1);
+	sem_init(&used_slots, 0, 0);
+}
+
+template <class T>
+BoundedBuffer<T>::~BoundedBuffer () {
+	sem_destroy(&free_slots);
+	sem_destroy(&used_slots);
+}
+
+template <class T>
+void BoundedBuffer<T>::push (const T& item) {
+	while (sem_wait(&free_slots) < 0) {}   // only fails with EINTR
+	// a slot is ours, but its last consumer may still be copying out of it
+	while (!ring.try_push(item)) {
+		std::this_thread::yield();
+	}
+	sem_post(&used_slots);
+}
+
+template <class T>
+T BoundedBuffer<T>::pop () {
+	while (sem_wait(&used_slots) < 0) {}
+	T item;
+	// an item is ours, but its producer may still be copying into the slot
+	while (!ring.try_pop(item)) {
+		std::this_thread::yield();
+	}
+	sem_post(&free_slots);
+	return item;
+}
+
+#endif
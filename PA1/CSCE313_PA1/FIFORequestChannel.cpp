@@ -6,7 +6,7 @@ using namespace std;
 /*		CONSTRUCTOR/DESTRUCTOR FOR CLASS	R e q u e s t C h a n n e l		*/
 /*--------------------------------------------------------------------------*/
 
-FIFORequestChannel::FIFORequestChannel (const string _name, const Side _side) : my_name( _name), my_side(_side) {
+FIFORequestChannel::FIFORequestChannel (const string _name, const Side _side) : RequestChannel(_name, _side) {
 	pipe1 = "fifo_" + my_name + "1";
 	pipe2 = "fifo_" + my_name + "2";
 		
@@ -49,6 +49,55 @@ int FIFORequestChannel::cwrite (void* msgbuf, int msgsize) {
 	return write (wfd, msgbuf, msgsize);
 }
 
-string FIFORequestChannel::name () {
-	return my_name;
+int FIFORequestChannel::cread_nonblocking (void* msgbuf, int msgsize) {
+	if (!rfd_nonblocking) {
+		fcntl(rfd, F_SETFL, fcntl(rfd, F_GETFL) | O_NONBLOCK);
+		rfd_nonblocking = true;
+	}
+	return read (rfd, msgbuf, msgsize);
+}
+
+int FIFORequestChannel::read_fd () {
+	return rfd;
+}
+
+int FIFORequestChannel::cwrite_nonblocking (void* msgbuf, int msgsize) {
+	if (!wfd_nonblocking) {
+		fcntl(wfd, F_SETFL, fcntl(wfd, F_GETFL) | O_NONBLOCK);
+		wfd_nonblocking = true;
+	}
+	return write (wfd, msgbuf, msgsize);
+}
+
+int FIFORequestChannel::write_fd () {
+	return wfd;
+}
+
+int FIFORequestChannel::buffer_writes (int write_size) {
+	int page = sysconf(_SC_PAGESIZE);
+	int capacity = fcntl(wfd, F_GETPIPE_SZ);
+	if (capacity <= 0) {
+		capacity = 16 * page;
+	}
+	write_size = max(1, write_size);
+	if (write_size > page) {
+		return max(1, capacity / write_size);
+	}
+	return capacity / page * (page / write_size);
+}
+
+int FIFORequestChannel::csendfile (int filefd, __int64_t offset, int length) {
+	loff_t off = offset;
+	int sent = 0;
+	while (sent < length) {
+		ssize_t n = splice(filefd, &off, wfd, NULL, length - sent, SPLICE_F_MOVE);
+		if (n < 0) {
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		sent += n;
+	}
+	return sent;
 }
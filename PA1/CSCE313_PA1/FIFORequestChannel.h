@@ -1,21 +1,16 @@
 #ifndef _FIFORequestChannel_H_
 #define _FIFORequestChannel_H_
 
-#include "common.h"
+#include "RequestChannel.h"
 
 
-class FIFORequestChannel {
-public:
-	enum Side {SERVER_SIDE, CLIENT_SIDE};
-	enum Mode {READ_MODE, WRITE_MODE};
-	
+class FIFORequestChannel : public RequestChannel {
 private:
 	/*  The current implementation uses named pipes. */
-	std::string my_name;
-	Side my_side;
-	
 	int wfd;
 	int rfd;
+	bool rfd_nonblocking = false;
+	bool wfd_nonblocking = false;
 	
 	std::string pipe1, pipe2;
 	int open_pipe (std::string _pipe_name, int mode);
@@ -42,7 +37,7 @@ public:
 	 mechanisms associated with the channel. */
 
 
-	int cread (void* msgbuf, int msgsize);
+	int cread (void* msgbuf, int msgsize) override;
 	/* Blocking read of data from the channel. You must provide the address to properly allocated
 	memory buffer and its capacity as arguments. The 2nd argument is needed because the recepient 
 	side may not have as much capacity as the sender wants to send.
@@ -50,12 +45,31 @@ public:
 	In reply, the function puts the read data in the buffer and  
 	returns an integer that tells how much data is read. If the read fails, it returns -1. */
 	
-	int cwrite (void *msgbuf, int msgsize);
+	int cwrite (void *msgbuf, int msgsize) override;
 	/* Writes msglen bytes from the msgbuf to the channel. The function returns the actual number of 
 	bytes written and that can be less than msglen (even 0) probably due to buffer limitation (e.g., the recepient
 	cannot accept msglen bytes due to its own buffer capacity. */
-	 
-	std::string name (); 
+
+	int cread_nonblocking (void* msgbuf, int msgsize) override;
+	/* Switches the read end of the pipe to O_NONBLOCK on first use; the write end
+	is left alone. */
+
+	int read_fd () override;
+
+	int cwrite_nonblocking (void* msgbuf, int msgsize) override;
+	/* Switches the write end of the pipe to O_NONBLOCK on first use, after which
+	cwrite can come back short as well, so a channel written this way should
+	stay with it. */
+
+	int write_fd () override;
+
+	int buffer_writes (int write_size) override;
+	/* A pipe holds its capacity in pages, and a small write is appended to the
+	 last page only if it fits there whole. */
+
+	int csendfile (int filefd, __int64_t offset, int length) override;
+	/* Splices the file range into the write pipe, so the bytes never pass through
+	the server's memory. */
 };
 
 #endif
@@ -0,0 +1,87 @@
+#include "FileCache.h"
+
+using namespace std;
+
+/*--------------------------------------------------------------------------*/
+/*			CONSTRUCTOR/DESTRUCTOR FOR CLASS	O p e n F i l e				*/
+/*--------------------------------------------------------------------------*/
+
+OpenFile::OpenFile (int _fd, const struct stat& _st) : fd(_fd), st(_st) {}
+
+OpenFile::~OpenFile () {
+	close(fd);
+}
+
+/*--------------------------------------------------------------------------*/
+/*			MEMBER FUNCTIONS FOR CLASS	F i l e C a c h e					*/
+/*--------------------------------------------------------------------------*/
+
+static bool same_file (const struct stat& a, const struct stat& b) {
+	return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_size == b.st_size
+		&& a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+FileCache::FileCache (size_t _capacity, int _revalidate_ms) : capacity(max((size_t) 1, _capacity)), revalidate_interval(_revalidate_ms) {}
+
+shared_ptr<OpenFile> FileCache::acquire (const string& filename, bool revalidate) {
+	auto now = chrono::steady_clock::now();
+	{
+		lock_guard<mutex> lock(mtx);
+		auto it = index.find(filename);
+		if (it != index.end()) {
+			entry& e = *(it->second);
+			struct stat st;
+			bool fresh = (!revalidate && now - e.checked < revalidate_interval)
+				|| (stat(filename.c_str(), &st) == 0 && same_file(st, e.file->st));
+			if (fresh) {
+				e.checked = now;
+				lru.splice(lru.begin(), lru, it->second);
+				hits++;
+				return e.file;
+			}
+			// changed on disk: drop it, holders keep the old descriptor until they are done
+			lru.erase(it->second);
+			index.erase(it);
+		}
+		misses++;
+	}
+
+	// open outside the lock so a slow open does not hold up the other channels
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return nullptr;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return nullptr;
+	}
+	shared_ptr<OpenFile> file = make_shared<OpenFile>(fd, st);
+
+	lock_guard<mutex> lock(mtx);
+	auto it = index.find(filename);
+	if (it != index.end()) {
+		// another thread opened it in the meantime, keep the newest stat
+		it->second->file = file;
+		it->second->checked = now;
+		lru.splice(lru.begin(), lru, it->second);
+		return file;
+	}
+	lru.push_front(entry{filename, file, now});
+	index[filename] = lru.begin();
+	if (lru.size() > capacity) {
+		index.erase(lru.back().filename);
+		lru.pop_back();
+	}
+	return file;
+}
+
+size_t FileCache::hit_count () {
+	lock_guard<mutex> lock(mtx);
+	return hits;
+}
+
+size_t FileCache::miss_count () {
+	lock_guard<mutex> lock(mtx);
+	return misses;
+}
@@ -0,0 +1,61 @@
+#ifndef _FileCache_H_
+#define _FileCache_H_
+
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "common.h"
+
+
+/* An open file together with the stat taken when it was opened. The descriptor
+ is closed when the last holder lets go of it, so a file evicted from the cache
+ stays usable by the threads that are still serving a chunk from it. */
+class OpenFile {
+public:
+	int fd;
+	struct stat st;
+
+	OpenFile (int _fd, const struct stat& _st);
+	~OpenFile ();
+};
+
+
+class FileCache {
+private:
+	struct entry {
+		std::string filename;
+		std::shared_ptr<OpenFile> file;
+		std::chrono::steady_clock::time_point checked; // last time st was compared with the path
+	};
+
+	size_t capacity;
+	std::chrono::milliseconds revalidate_interval;
+
+	std::mutex mtx;
+	std::list<entry> lru;	// most recently used first
+	std::unordered_map<std::string, std::list<entry>::iterator> index;
+
+	size_t hits = 0;
+	size_t misses = 0;
+
+public:
+	FileCache (size_t _capacity, int _revalidate_ms = 100);
+	/* Keeps at most _capacity files open. A cached entry is compared against the
+	 path with stat at most once every _revalidate_ms milliseconds; if the file was
+	 replaced or modified (inode, size or mtime differ) it is reopened. */
+
+	std::shared_ptr<OpenFile> acquire (const std::string& filename, bool revalidate = false);
+	/* Returns the open file for filename, opening it (and evicting the least
+	 recently used file if the cache is full) on a miss. With revalidate the
+	 entry is checked against the path regardless of when it was last checked.
+	 Returns nullptr if the file cannot be opened. Safe to call from any number
+	 of threads. */
+
+	size_t hit_count ();
+	size_t miss_count ();
+};
+
+#endif
@@ -0,0 +1,45 @@
+#include "Histogram.h"
+
+using namespace std;
+
+/*--------------------------------------------------------------------------*/
+/*			CONSTRUCTOR/DESTRUCTOR FOR CLASS	H i s t o g r a m			*/
+/*--------------------------------------------------------------------------*/
+
+Histogram::Histogram (int _nbins, double _start, double _end) : hist(max(1, _nbins), 0), start(_start), end(_end) {}
+
+/*--------------------------------------------------------------------------*/
+/*			MEMBER FUNCTIONS FOR CLASS	H i s t o g r a m					*/
+/*--------------------------------------------------------------------------*/
+
+void Histogram::update (double value) {
+	int nbins = hist.size();
+	int bin = (int) floor((value - start) / (end - start) * nbins);
+	hist[min(max(bin, 0), nbins - 1)]++;
+}
+
+void Histogram::merge (const Histogram& other) {
+	for (size_t i = 0; i < hist.size() && i < other.hist.size(); i++) {
+		hist[i] += other.hist[i];
+	}
+}
+
+int Histogram::count () {
+	int total = 0;
+	for (int c : hist) {
+		total += c;
+	}
+	return total;
+}
+
+vector<int> Histogram::get () {
+	return hist;
+}
+
+vector<double> Histogram::bin_starts () {
+	vector<double> starts;
+	for (size_t i = 0; i < hist.size(); i++) {
+		starts.push_back(start + (end - start) * i / hist.size());
+	}
+	return starts;
+}
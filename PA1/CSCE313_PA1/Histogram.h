@@ -0,0 +1,37 @@
+#ifndef _Histogram_H_
+#define _Histogram_H_
+
+#include "common.h"
+
+/* The bins of an ECG histogram: samples lie within about +-2 mV, and the few
+ beyond go into the first or last bin. */
+#define ECG_HIST_BINS	10
+#define ECG_HIST_START	-2.0
+#define ECG_HIST_END	2.0
+
+
+/* Counts of values falling into nbins equal-width bins over [start, end).
+ Values outside the range go into the first or the last bin. Not thread-safe:
+ every histogram thread fills its own and they are merged once at the end. */
+class Histogram {
+private:
+	std::vector<int> hist;
+	double start;
+	double end;
+
+public:
+	Histogram (int _nbins, double _start, double _end);
+
+	void update (double value);
+
+	void merge (const Histogram& other);
+	/* Adds the counts of other, which must have the same bins. */
+
+	int count ();
+	/* Total number of values counted. */
+
+	std::vector<int> get ();
+	std::vector<double> bin_starts ();
+};
+
+#endif
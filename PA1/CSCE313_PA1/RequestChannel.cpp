@@ -0,0 +1,69 @@
+#include "RequestChannel.h"
+#include "FIFORequestChannel.h"
+#include "SHMRequestChannel.h"
+#include "TCPRequestChannel.h"
+#include "UNIXRequestChannel.h"
+
+using namespace std;
+
+/*--------------------------------------------------------------------------*/
+/*		CONSTRUCTOR/DESTRUCTOR FOR CLASS	R e q u e s t C h a n n e l		*/
+/*--------------------------------------------------------------------------*/
+
+RequestChannel::RequestChannel (const string _name, const Side _side) : my_name(_name), my_side(_side) {}
+
+RequestChannel::~RequestChannel () {}
+
+/*--------------------------------------------------------------------------*/
+/*			MEMBER FUNCTIONS FOR CLASS	R e q u e s t C h a n n e l			*/
+/*--------------------------------------------------------------------------*/
+
+int RequestChannel::cread_nonblocking (void*, int) {
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int RequestChannel::read_fd () {
+	return -1;
+}
+
+int RequestChannel::cwrite_nonblocking (void*, int) {
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int RequestChannel::write_fd () {
+	return -1;
+}
+
+int RequestChannel::buffer_writes (int write_size) {
+	return max(1, 65536 / max(1, write_size));
+}
+
+int RequestChannel::csendfile (int filefd, __int64_t offset, int length) {
+	vector<char> buf(length);
+	int nbytes = pread(filefd, buf.data(), length, offset);
+	if (nbytes <= 0) {
+		return nbytes;
+	}
+	return cwrite(buf.data(), nbytes);
+}
+
+string RequestChannel::name () {
+	return my_name;
+}
+
+RequestChannel* RequestChannel::create (const char _transport, const string _name, const Side _side) {
+	switch (_transport) {
+		case 'f':
+			return new FIFORequestChannel(_name, _side);
+		case 's':
+			return new SHMRequestChannel(_name, _side);
+		case 'u':
+			return new UNIXRequestChannel(_name, _side);
+		case 't':
+			return new TCPRequestChannel(_name, _side);
+	}
+	cerr << "Unknown transport '" << _transport << "', expected one of f|s|u|t" << endl;
+	exit(-1);
+}
@@ -0,0 +1,73 @@
+#ifndef _RequestChannel_H_
+#define _RequestChannel_H_
+
+#include "common.h"
+
+
+class RequestChannel {
+public:
+	enum Side {SERVER_SIDE, CLIENT_SIDE};
+	enum Mode {READ_MODE, WRITE_MODE};
+
+protected:
+	std::string my_name;
+	Side my_side;
+
+public:
+	RequestChannel (const std::string _name, const Side _side);
+	/* Common state of every transport. Concrete channels (FIFORequestChannel,
+	 SHMRequestChannel, UNIXRequestChannel, TCPRequestChannel) set up their IPC
+	 mechanisms in their own constructors. */
+
+	virtual ~RequestChannel ();
+	/* Releases the IPC mechanisms of the concrete transport. */
+
+	virtual int cread (void* msgbuf, int msgsize) = 0;
+	/* Blocking read of at most msgsize bytes into msgbuf. Returns the number of
+	 bytes read, 0 once the other side has closed the channel, or -1 on failure. */
+
+	virtual int cwrite (void* msgbuf, int msgsize) = 0;
+	/* Writes msgsize bytes from msgbuf to the channel. Returns the number of
+	 bytes written, or -1 on failure. */
+
+	virtual int cread_nonblocking (void* msgbuf, int msgsize);
+	/* Like cread, but returns -1 with errno set to EAGAIN when nothing is there
+	 instead of blocking. Transports without a pollable descriptor fail with
+	 EOPNOTSUPP. */
+
+	virtual int read_fd ();
+	/* Descriptor that polls readable when cread has something to return, for
+	 multiplexing many channels with epoll, or -1 if the transport has none
+	 (shared memory). */
+
+	virtual int cwrite_nonblocking (void* msgbuf, int msgsize);
+	/* Like cwrite, but writes only as much of msgbuf as the channel takes right
+	 now and returns that count, or -1 with errno set to EAGAIN if it takes
+	 nothing. Transports without a pollable descriptor fail with EOPNOTSUPP. */
+
+	virtual int write_fd ();
+	/* Descriptor that polls writable when cwrite_nonblocking can make progress,
+	 which is read_fd itself for sockets, or -1 if the transport has none. */
+
+	virtual int buffer_writes (int write_size);
+	/* How many writes of write_size bytes one side can make before it blocks
+	 while the other side reads nothing, at least 1. A client keeping requests
+	 in flight stays within it, or both sides can end up blocked on full
+	 writes. This fallback allows 64 KB, less than TCP buffers. */
+
+	virtual int csendfile (int filefd, __int64_t offset, int length);
+	/* Writes length bytes of the open file filefd, starting at offset, to the
+	 channel. Transports override it to move the bytes inside the kernel
+	 (splice, sendfile) or straight into shared memory; this fallback goes
+	 through a user-space buffer. Returns the number of bytes written, which is
+	 short only at end of file, or -1 on failure. */
+
+	std::string name ();
+
+	static RequestChannel* create (const char _transport, const std::string _name, const Side _side);
+	/* Factory used by the client and server to build a channel of the transport
+	 selected with -i: 'f' for named pipes, 's' for shared memory, 'u' for a
+	 UNIX-domain socket and 't' for TCP over loopback. Exits on an unknown transport. */
+};
+
+#endif
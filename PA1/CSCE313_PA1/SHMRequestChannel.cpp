@@ -0,0 +1,220 @@
+#include <climits>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "SHMRequestChannel.h"
+
+using namespace std;
+
+/*--------------------------------------------------------------------------*/
+/*			LOCAL HELPERS FOR THE SHARED MEMORY RING BUFFERS				*/
+/*--------------------------------------------------------------------------*/
+
+/* The segment is shared between processes, so these are deliberately not the
+ FUTEX_PRIVATE_FLAG variants. */
+static void futex_wait (atomic<uint32_t>* word, uint32_t expected) {
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+static void futex_wake (atomic<uint32_t>* word, int nwaiters) {
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, nwaiters, NULL, NULL, 0);
+}
+
+static void ring_copy_in (shm_ring* r, uint64_t pos, const char* src, size_t n) {
+	size_t start = pos % SHM_RING_SIZE;
+	size_t first = min(n, (size_t) SHM_RING_SIZE - start);
+	memcpy(r->data + start, src, first);
+	memcpy(r->data, src + first, n - first);
+}
+
+static void ring_copy_out (shm_ring* r, uint64_t pos, char* dst, size_t n) {
+	size_t start = pos % SHM_RING_SIZE;
+	size_t first = min(n, (size_t) SHM_RING_SIZE - start);
+	memcpy(dst, r->data + start, first);
+	memcpy(dst + first, r->data, n - first);
+}
+
+/* Writer side: blocks until n bytes past tail t are free. Returns false if the
+ reader has closed the channel. */
+static bool ring_wait_for_space (shm_ring* r, uint64_t t, uint64_t n) {
+	while (SHM_RING_SIZE - (t - r->head.load(memory_order_acquire)) < n) {
+		if (r->reader_closed.load()) {
+			return false;
+		}
+		r->writers_waiting.fetch_add(1);
+		uint32_t seq = r->head_seq.load();
+		if (SHM_RING_SIZE - (t - r->head.load()) < n && !r->reader_closed.load()) {
+			futex_wait(&r->head_seq, seq);
+		}
+		r->writers_waiting.fetch_sub(1);
+	}
+	return !r->reader_closed.load();
+}
+
+/* Writer side: makes everything up to tail t visible and wakes a sleeping reader. */
+static void ring_publish (shm_ring* r, uint64_t t) {
+	r->tail.store(t, memory_order_release);
+	r->tail_seq.fetch_add(1);
+	if (r->readers_waiting.load()) {
+		futex_wake(&r->tail_seq, 1);
+	}
+}
+
+/*--------------------------------------------------------------------------*/
+/*		CONSTRUCTOR/DESTRUCTOR FOR CLASS	S H M R e q u e s t C h a n n e l	*/
+/*--------------------------------------------------------------------------*/
+
+SHMRequestChannel::SHMRequestChannel (const string _name, const Side _side) : RequestChannel(_name, _side) {
+	shm_name = "/shm_" + my_name;
+
+	bool creator = true;
+	int fd = shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 && errno == EEXIST) {
+		creator = false;
+		fd = shm_open(shm_name.c_str(), O_RDWR, 0600);
+	}
+	if (fd < 0) {
+		EXITONERROR(shm_name);
+	}
+
+	if (creator) {
+		// ftruncate zero-fills, and all-zero is the initial state of both rings
+		if (ftruncate(fd, sizeof(shm_segment)) < 0) {
+			EXITONERROR(shm_name);
+		}
+	}
+	else {
+		// touching the mapping before the creator has sized it would SIGBUS
+		struct stat st;
+		while (fstat(fd, &st) == 0 && st.st_size < (off_t) sizeof(shm_segment)) {
+			usleep(100);
+		}
+	}
+
+	void* addr = mmap(NULL, sizeof(shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		EXITONERROR(shm_name);
+	}
+	seg = (shm_segment*) addr;
+
+	// rendezvous with the other side, the same way opening a FIFO blocks until both ends are open
+	seg->attached.fetch_add(1);
+	futex_wake(&seg->attached, INT_MAX);
+	uint32_t attached;
+	while ((attached = seg->attached.load()) < 2) {
+		futex_wait(&seg->attached, attached);
+	}
+
+	if (_side == SERVER_SIDE) {
+		out = &seg->ring[0];
+		in = &seg->ring[1];
+	}
+	else {
+		in = &seg->ring[0];
+		out = &seg->ring[1];
+	}
+}
+
+SHMRequestChannel::~SHMRequestChannel () {
+	out->writer_closed.store(1);
+	out->tail_seq.fetch_add(1);
+	futex_wake(&out->tail_seq, INT_MAX);
+
+	in->reader_closed.store(1);
+	in->head_seq.fetch_add(1);
+	futex_wake(&in->head_seq, INT_MAX);
+
+	munmap(seg, sizeof(shm_segment));
+	shm_unlink(shm_name.c_str());
+}
+
+/*--------------------------------------------------------------------------*/
+/*		MEMBER FUNCTIONS FOR CLASS	S H M R e q u e s t C h a n n e l		*/
+/*--------------------------------------------------------------------------*/
+
+int SHMRequestChannel::cread (void* msgbuf, int msgsize) {
+	if (msgsize <= 0) {
+		return 0;
+	}
+
+	uint64_t h = in->head.load(memory_order_relaxed);
+	uint64_t t;
+	while ((t = in->tail.load(memory_order_acquire)) == h) {
+		if (in->writer_closed.load()) {
+			t = in->tail.load(memory_order_acquire);
+			if (t == h) {
+				return 0;
+			}
+			break;
+		}
+		in->readers_waiting.fetch_add(1);
+		uint32_t seq = in->tail_seq.load();
+		if (in->tail.load() == h && !in->writer_closed.load()) {
+			futex_wait(&in->tail_seq, seq);
+		}
+		in->readers_waiting.fetch_sub(1);
+	}
+
+	size_t n = min((uint64_t) msgsize, t - h);
+	ring_copy_out(in, h, (char*) msgbuf, n);
+	in->head.store(h + n, memory_order_release);
+
+	in->head_seq.fetch_add(1);
+	if (in->writers_waiting.load()) {
+		futex_wake(&in->head_seq, 1);
+	}
+	return (int) n;
+}
+
+int SHMRequestChannel::cwrite (void* msgbuf, int msgsize) {
+	const char* src = (const char*) msgbuf;
+	int sent = 0;
+	while (sent < msgsize) {
+		uint64_t n = min(msgsize - sent, SHM_RING_SIZE);
+		uint64_t t = out->tail.load(memory_order_relaxed);
+		if (!ring_wait_for_space(out, t, n)) {
+			return -1;
+		}
+		ring_copy_in(out, t, src + sent, n);
+		ring_publish(out, t + n);
+		sent += n;
+	}
+	return sent;
+}
+
+int SHMRequestChannel::buffer_writes (int write_size) {
+	return max(1, SHM_RING_SIZE / max(1, write_size));
+}
+
+int SHMRequestChannel::csendfile (int filefd, __int64_t offset, int length) {
+	int sent = 0;
+	while (sent < length) {
+		uint64_t n = min(length - sent, SHM_RING_SIZE);
+		uint64_t t = out->tail.load(memory_order_relaxed);
+		if (!ring_wait_for_space(out, t, n)) {
+			return -1;
+		}
+		// read from the file straight into the ring, in two pieces if it wraps around
+		size_t start = t % SHM_RING_SIZE;
+		size_t first = min((size_t) n, (size_t) SHM_RING_SIZE - start);
+		ssize_t got = pread(filefd, out->data + start, first, offset + sent);
+		if (got == (ssize_t) first && n > first) {
+			ssize_t rest = pread(filefd, out->data, n - first, offset + sent + first);
+			got += max(rest, (ssize_t) 0);
+		}
+		if (got < 0) {
+			return -1;
+		}
+		if (got == 0) {
+			break;
+		}
+		ring_publish(out, t + got);
+		sent += got;
+		if ((uint64_t) got < n) {
+			break;
+		}
+	}
+	return sent;
+}
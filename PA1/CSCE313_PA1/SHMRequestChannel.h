@@ -0,0 +1,74 @@
+#ifndef _SHMRequestChannel_H_
+#define _SHMRequestChannel_H_
+
+#include <atomic>
+#include <stdint.h>
+
+#include "RequestChannel.h"
+
+#define SHM_RING_SIZE 65536 // bytes per direction, same as the default pipe capacity
+
+
+/* One direction of the channel: a single-producer/single-consumer byte ring.
+ head and tail are free-running byte counters, so tail - head is the number of
+ unread bytes. Each side has its own sequence word that the other side sleeps on
+ with a futex, and the wake is only issued when someone is actually waiting. */
+struct shm_ring {
+	alignas(64) std::atomic<uint64_t> head;     // advanced by the reader
+	std::atomic<uint32_t> head_seq;
+	std::atomic<uint32_t> writers_waiting;
+
+	alignas(64) std::atomic<uint64_t> tail;     // advanced by the writer
+	std::atomic<uint32_t> tail_seq;
+	std::atomic<uint32_t> readers_waiting;
+
+	alignas(64) std::atomic<uint32_t> writer_closed;
+	std::atomic<uint32_t> reader_closed;
+
+	alignas(64) char data[SHM_RING_SIZE];
+};
+
+struct shm_segment {
+	std::atomic<uint32_t> attached;   // number of sides that have mapped the segment
+	shm_ring ring[2];   // ring[0] carries server -> client, ring[1] client -> server
+};
+
+
+class SHMRequestChannel : public RequestChannel {
+private:
+	/*  This implementation uses one POSIX shared memory segment per channel. */
+	std::string shm_name;
+	shm_segment* seg;
+
+	shm_ring* in;
+	shm_ring* out;
+
+public:
+	SHMRequestChannel (const std::string _name, const Side _side);
+	/* Creates or attaches to the shared memory segment "/shm_<name>". Whichever
+	 side gets there first creates it, and like the FIFO channel the constructor
+	 blocks until the other side has attached too. Exits if the segment cannot be
+	 created or mapped. */
+
+	~SHMRequestChannel ();
+	/* Marks both directions closed for this side, wakes the peer and unmaps the
+	 segment. Both sides unlink the name, whichever goes second gets ENOENT. */
+
+	int cread (void* msgbuf, int msgsize) override;
+	/* Blocks until the ring has data, then copies at most msgsize bytes. Returns 0
+	 when the other side has closed the channel and everything has been read. */
+
+	int cwrite (void* msgbuf, int msgsize) override;
+	/* Copies msgsize bytes into the ring. A message that fits in the ring is
+	 published at once, so the reader never sees half of it, like a pipe write
+	 under PIPE_BUF. Returns -1 if the reader has closed the channel. */
+
+	int buffer_writes (int write_size) override;
+	/* As many as fit in a direction's ring. */
+
+	int csendfile (int filefd, __int64_t offset, int length) override;
+	/* Reads the file range with pread directly into the ring, so there is no
+	 intermediate buffer on the server. */
+};
+
+#endif
@@ -0,0 +1,122 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "TCPRequestChannel.h"
+
+using namespace std;
+
+/*--------------------------------------------------------------------------*/
+/*		CONSTRUCTOR/DESTRUCTOR FOR CLASS	T C P R e q u e s t C h a n n e l	*/
+/*--------------------------------------------------------------------------*/
+
+TCPRequestChannel::TCPRequestChannel (const string _name, const Side _side) : RequestChannel(_name, _side) {
+	port_file = "tcp_" + my_name;
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	if (_side == SERVER_SIDE) {
+		int lfd = socket(AF_INET, SOCK_STREAM, 0);
+		if (lfd < 0) {
+			EXITONERROR(port_file);
+		}
+		socklen_t len = sizeof(addr);
+		if (bind(lfd, (struct sockaddr*) &addr, len) < 0 || listen(lfd, 1) < 0
+				|| getsockname(lfd, (struct sockaddr*) &addr, &len) < 0) {
+			EXITONERROR(port_file);
+		}
+
+		// write then rename, so the client never reads a half-written port number
+		string tmp_file = port_file + ".tmp";
+		ofstream ofs(tmp_file);
+		ofs << ntohs(addr.sin_port) << endl;
+		ofs.close();
+		rename(tmp_file.c_str(), port_file.c_str());
+
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			EXITONERROR(port_file);
+		}
+		close(lfd);
+		remove(port_file.c_str());
+	}
+	else {
+		// the port file may not be there yet, or may be stale from an old run
+		while (true) {
+			int port = 0;
+			ifstream ifs(port_file);
+			if (ifs >> port) {
+				addr.sin_port = htons(port);
+				fd = socket(AF_INET, SOCK_STREAM, 0);
+				if (fd < 0) {
+					EXITONERROR(port_file);
+				}
+				if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+					break;
+				}
+				if (errno != ECONNREFUSED) {
+					EXITONERROR(port_file);
+				}
+				close(fd);
+			}
+			usleep(1000);
+		}
+	}
+
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+TCPRequestChannel::~TCPRequestChannel () {
+	close(fd);
+}
+
+/*--------------------------------------------------------------------------*/
+/*		MEMBER FUNCTIONS FOR CLASS	T C P R e q u e s t C h a n n e l		*/
+/*--------------------------------------------------------------------------*/
+
+int TCPRequestChannel::cread (void* msgbuf, int msgsize) {
+	return read(fd, msgbuf, msgsize);
+}
+
+int TCPRequestChannel::cwrite (void* msgbuf, int msgsize) {
+	return write(fd, msgbuf, msgsize);
+}
+
+int TCPRequestChannel::cread_nonblocking (void* msgbuf, int msgsize) {
+	return recv(fd, msgbuf, msgsize, MSG_DONTWAIT);
+}
+
+int TCPRequestChannel::read_fd () {
+	return fd;
+}
+
+int TCPRequestChannel::cwrite_nonblocking (void* msgbuf, int msgsize) {
+	return send(fd, msgbuf, msgsize, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+int TCPRequestChannel::write_fd () {
+	return fd;
+}
+
+int TCPRequestChannel::csendfile (int filefd, __int64_t offset, int length) {
+	off_t off = offset;
+	int sent = 0;
+	while (sent < length) {
+		ssize_t n = sendfile(fd, filefd, &off, length - sent);
+		if (n < 0) {
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		sent += n;
+	}
+	return sent;
+}
@@ -0,0 +1,48 @@
+#ifndef _TCPRequestChannel_H_
+#define _TCPRequestChannel_H_
+
+#include "RequestChannel.h"
+
+
+class TCPRequestChannel : public RequestChannel {
+private:
+	/*  This implementation uses a TCP connection over the loopback interface. */
+	int fd;
+
+	std::string port_file;
+
+public:
+	TCPRequestChannel (const std::string _name, const Side _side);
+	/* The server side listens on an ephemeral port of 127.0.0.1 and publishes the
+	 port number in the file "tcp_<name>", then blocks until the client side has
+	 connected and removes the file. The client side waits for the file to appear
+	 and connects to that port. Nagle's algorithm is disabled on both ends since
+	 every message is a small request or reply. Exits if the socket cannot be set up. */
+
+	~TCPRequestChannel ();
+	/* Closes the connection, which the other side reads as end of file. */
+
+	int cread (void* msgbuf, int msgsize) override;
+	/* Blocking read of at most msgsize bytes. Returns 0 once the other side has
+	 closed the channel, or -1 on failure. */
+
+	int cwrite (void* msgbuf, int msgsize) override;
+	/* Writes msgsize bytes to the socket and returns the number of bytes written,
+	 or -1 on failure. */
+
+	int cread_nonblocking (void* msgbuf, int msgsize) override;
+	/* recv with MSG_DONTWAIT, so the socket itself stays blocking for writes. */
+
+	int read_fd () override;
+
+	int cwrite_nonblocking (void* msgbuf, int msgsize) override;
+	/* send with MSG_DONTWAIT, and MSG_NOSIGNAL so a client that went away is an
+	 EPIPE and not a signal. */
+
+	int write_fd () override;
+
+	int csendfile (int filefd, __int64_t offset, int length) override;
+	/* Sends the file range with sendfile, without copying it through user space. */
+};
+
+#endif
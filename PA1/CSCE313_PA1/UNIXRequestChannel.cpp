@@ -0,0 +1,107 @@
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "UNIXRequestChannel.h"
+
+using namespace std;
+
+/*--------------------------------------------------------------------------*/
+/*		CONSTRUCTOR/DESTRUCTOR FOR CLASS	U N I X R e q u e s t C h a n n e l	*/
+/*--------------------------------------------------------------------------*/
+
+UNIXRequestChannel::UNIXRequestChannel (const string _name, const Side _side) : RequestChannel(_name, _side) {
+	sock_path = "sock_" + my_name;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, sock_path.c_str(), sizeof(addr.sun_path) - 1);
+
+	if (_side == SERVER_SIDE) {
+		int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (lfd < 0) {
+			EXITONERROR(sock_path);
+		}
+		unlink(sock_path.c_str());
+		if (bind(lfd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(lfd, 1) < 0) {
+			EXITONERROR(sock_path);
+		}
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			EXITONERROR(sock_path);
+		}
+		close(lfd);
+		unlink(sock_path.c_str());
+	}
+	else {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) {
+			EXITONERROR(sock_path);
+		}
+		// the server may not be listening yet, or a stale file from an old run may still be there
+		while (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+			if (errno != ENOENT && errno != ECONNREFUSED) {
+				EXITONERROR(sock_path);
+			}
+			usleep(1000);
+		}
+	}
+}
+
+UNIXRequestChannel::~UNIXRequestChannel () {
+	close(fd);
+}
+
+/*--------------------------------------------------------------------------*/
+/*		MEMBER FUNCTIONS FOR CLASS	U N I X R e q u e s t C h a n n e l		*/
+/*--------------------------------------------------------------------------*/
+
+int UNIXRequestChannel::cread (void* msgbuf, int msgsize) {
+	return read(fd, msgbuf, msgsize);
+}
+
+int UNIXRequestChannel::cwrite (void* msgbuf, int msgsize) {
+	return write(fd, msgbuf, msgsize);
+}
+
+int UNIXRequestChannel::cread_nonblocking (void* msgbuf, int msgsize) {
+	return recv(fd, msgbuf, msgsize, MSG_DONTWAIT);
+}
+
+int UNIXRequestChannel::read_fd () {
+	return fd;
+}
+
+int UNIXRequestChannel::cwrite_nonblocking (void* msgbuf, int msgsize) {
+	return send(fd, msgbuf, msgsize, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+int UNIXRequestChannel::write_fd () {
+	return fd;
+}
+
+int UNIXRequestChannel::buffer_writes (int write_size) {
+	int sndbuf = 0;
+	socklen_t len = sizeof(sndbuf);
+	if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) < 0) {
+		sndbuf = 212992; // net.core.wmem_default
+	}
+	return max(1, sndbuf / (max(1, write_size) + 1280));
+}
+
+int UNIXRequestChannel::csendfile (int filefd, __int64_t offset, int length) {
+	off_t off = offset;
+	int sent = 0;
+	while (sent < length) {
+		ssize_t n = sendfile(fd, filefd, &off, length - sent);
+		if (n < 0) {
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		sent += n;
+	}
+	return sent;
+}
@@ -0,0 +1,50 @@
+#ifndef _UNIXRequestChannel_H_
+#define _UNIXRequestChannel_H_
+
+#include "RequestChannel.h"
+
+
+class UNIXRequestChannel : public RequestChannel {
+private:
+	/*  This implementation uses a connected UNIX-domain stream socket. */
+	int fd;
+
+	std::string sock_path;
+
+public:
+	UNIXRequestChannel (const std::string _name, const Side _side);
+	/* The server side listens on the socket file "sock_<name>" and blocks until
+	 the client side has connected, then removes the file. The client side retries
+	 until the server is listening. Exits if the socket cannot be set up. */
+
+	~UNIXRequestChannel ();
+	/* Closes the connection, which the other side reads as end of file. */
+
+	int cread (void* msgbuf, int msgsize) override;
+	/* Blocking read of at most msgsize bytes. Returns 0 once the other side has
+	 closed the channel, or -1 on failure. */
+
+	int cwrite (void* msgbuf, int msgsize) override;
+	/* Writes msgsize bytes to the socket and returns the number of bytes written,
+	 or -1 on failure. */
+
+	int cread_nonblocking (void* msgbuf, int msgsize) override;
+	/* recv with MSG_DONTWAIT, so the socket itself stays blocking for writes. */
+
+	int read_fd () override;
+
+	int cwrite_nonblocking (void* msgbuf, int msgsize) override;
+	/* send with MSG_DONTWAIT, and MSG_NOSIGNAL so a client that went away is an
+	 EPIPE and not a signal. */
+
+	int write_fd () override;
+
+	int buffer_writes (int write_size) override;
+	/* Every write is a buffer of its own in the kernel, charged against the
+	 sender's SO_SNDBUF at its size plus about a kilobyte of bookkeeping. */
+
+	int csendfile (int filefd, __int64_t offset, int length) override;
+	/* Sends the file range with sendfile, without copying it through user space. */
+};
+
+#endif
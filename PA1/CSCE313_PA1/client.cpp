@@ -12,11 +12,393 @@
 */
 #include "common.h"
 //#include "stdlib.h"
-#include "FIFORequestChannel.h"
+#include "RequestChannel.h"
+#include "BoundedBuffer.h"
+#include "Histogram.h"
+#include <algorithm>
 #include <chrono>
+#include <random>
+#include <thread>
 
 using namespace std;
 
+// Asks the server for a new data channel over control and connects to it
+RequestChannel *open_new_channel(RequestChannel *control, char ipc)
+{
+	MESSAGE_TYPE msg = NEWCHANNEL_MSG;
+	// Write new channel message into pipe
+	control->cwrite(&msg, sizeof(MESSAGE_TYPE));
+	// Read response from pipe (Can create any static sized char array that fits server response, e.g. MAX_MESSAGE)
+	char newPipeName[MAX_MESSAGE];
+	control->cread(newPipeName, MAX_MESSAGE);
+	// Create a new channel object of the same transport using the name sent by server
+	return RequestChannel::create(ipc, newPipeName, RequestChannel::CLIENT_SIDE);
+}
+
+// Reads exactly msgsize bytes, since stream transports may hand back a reply in pieces
+void cread_full(RequestChannel *chan, void *msgbuf, int msgsize)
+{
+	int got = 0;
+	while (got < msgsize)
+	{
+		int read = chan->cread((char *)msgbuf + got, msgsize - got);
+		if (read <= 0)
+		{
+			EXITONERROR("Server closed the channel before replying");
+		}
+		got += read;
+	}
+}
+
+// Requests to keep in flight on chan: k, or fewer if the requests or the replies of
+// that many would not fit in the channel's buffers. Past that the server can block
+// writing replies the client is not reading yet, while the client blocks writing
+// requests the server is not reading.
+int clamp_window(RequestChannel *chan, int k, int request_size, int reply_size)
+{
+	int fits = min(chan->buffer_writes(request_size), chan->buffer_writes(reply_size));
+	if (k > fits)
+	{
+		cerr << "-k " << k << ": only " << fits << " requests of this size fit in the channel's buffers, keeping that many in flight" << endl;
+		return fits;
+	}
+	return k;
+}
+
+// Fetches bytes [start, end) of fname over chan and writes every chunk at its offset
+// in the output file. Up to k requests are kept in flight; the server answers them in order.
+void file_worker(RequestChannel *chan, string fname, __int64_t start, __int64_t end, int m, int k, int fd)
+{
+	int len = sizeof(filemsg) + (fname.size() + 1);
+	char *buf2 = new char[len];
+	filemsg fm(0, 0);
+	memcpy(buf2, &fm, sizeof(filemsg));
+	strcpy(buf2 + sizeof(filemsg), fname.c_str());
+
+	filemsg *freq = (filemsg *)buf2;
+	char *buf3 = new char[m];
+	__int64_t requested = start;
+	for (__int64_t i = start; i < end; i += m)
+	{
+		// Top up the window before waiting for the oldest reply
+		while (requested < end && requested - i < (__int64_t)k * m)
+		{
+			freq->offset = requested;
+			freq->length = min((__int64_t)m, end - requested);
+			chan->cwrite(buf2, len);
+			requested += freq->length;
+		}
+		int length = min((__int64_t)m, end - i);
+		cread_full(chan, buf3, length);
+		if (pwrite(fd, buf3, length, i) != length)
+		{
+			EXITONERROR("pwrite to received/" + fname);
+		}
+	}
+	delete[] buf2;
+	delete[] buf3;
+}
+
+// Asks the server to push bytes [start, end) of fname over chan with one STREAM_FILE_MSG,
+// then drains whatever arrives into the output file until the whole range is in
+void stream_worker(RequestChannel *chan, string fname, __int64_t start, __int64_t end, int fd)
+{
+	if (start >= end)
+	{
+		return; // a length of 0 would mean "to the end of the file"
+	}
+	int len = sizeof(streamfilemsg) + (fname.size() + 1);
+	char *buf2 = new char[len];
+	streamfilemsg sm(start, end - start);
+	memcpy(buf2, &sm, sizeof(streamfilemsg));
+	strcpy(buf2 + sizeof(streamfilemsg), fname.c_str());
+	chan->cwrite(buf2, len);
+	delete[] buf2;
+
+	__int64_t total;
+	cread_full(chan, &total, sizeof(__int64_t));
+	if (total != end - start)
+	{
+		cerr << "Server is streaming " << total << " bytes of " << fname << " instead of " << end - start << endl;
+	}
+
+	const int drain = 64 * 1024;
+	char *buf3 = new char[drain];
+	for (__int64_t i = start; i < start + total;)
+	{
+		int read = chan->cread(buf3, min((__int64_t)drain, start + total - i));
+		if (read <= 0)
+		{
+			EXITONERROR("Server closed the channel during a stream");
+		}
+		if (pwrite(fd, buf3, read, i) != read)
+		{
+			EXITONERROR("pwrite to received/" + fname);
+		}
+		i += read;
+	}
+	delete[] buf3;
+}
+
+// Prints the lines of /proc/<pid>/status that show what keeping channels open costs the server
+void print_server_usage(pid_t pid)
+{
+	ifstream status("/proc/" + to_string(pid) + "/status");
+	string line;
+	while (getline(status, line))
+	{
+		if (line.rfind("VmRSS:", 0) == 0 || line.rfind("VmSize:", 0) == 0 || line.rfind("Threads:", 0) == 0)
+		{
+			cout << "  server " << line << endl;
+		}
+	}
+}
+
+// Prints the median and the 99th percentile of the latencies in us, which are sorted in place
+void print_latency(string label, vector<double> &us)
+{
+	sort(us.begin(), us.end());
+	cout << label << ": p50 " << us[us.size() / 2] << " us, p99 " << us[us.size() * 99 / 100] << " us" << endl;
+}
+
+// -n: opens n data channels and measures the round trip of one small file request
+// on them, first one request at a time on random channels, then with a request
+// outstanding on every channel at once. Used to compare the server's one thread
+// per channel against its -E event loop.
+void channel_bench(RequestChannel *control, char ipc, int n, vector<RequestChannel *> &channels, pid_t server)
+{
+	auto open_start = chrono::high_resolution_clock::now();
+	vector<RequestChannel *> bench;
+	for (int j = 0; j < n; j++)
+	{
+		bench.push_back(open_new_channel(control, ipc));
+		channels.push_back(bench.back());
+	}
+	auto open_end = chrono::high_resolution_clock::now();
+	cout << "Opened " << n << " channels in " << chrono::duration_cast<chrono::milliseconds>(open_end - open_start).count() << " ms" << endl;
+	print_server_usage(server);
+
+	const int chunk = 256;
+	string fname = "1.csv";
+	int len = sizeof(filemsg) + (fname.size() + 1);
+	vector<char> req(len);
+	filemsg fm(0, chunk);
+	memcpy(req.data(), &fm, sizeof(filemsg));
+	strcpy(req.data() + sizeof(filemsg), fname.c_str());
+	char reply[chunk];
+
+	mt19937 rng(313);
+	vector<double> single;
+	for (int r = 0; r < 10000; r++)
+	{
+		RequestChannel *c = bench[rng() % n];
+		auto start = chrono::high_resolution_clock::now();
+		c->cwrite(req.data(), len);
+		cread_full(c, reply, chunk);
+		single.push_back(chrono::duration<double, micro>(chrono::high_resolution_clock::now() - start).count());
+	}
+	print_latency("One request at a time", single);
+
+	// Every channel gets a request before any reply is read, so each latency
+	// includes the wait behind the other channels' requests
+	vector<double> burst;
+	for (int round = 0; round < max(1, 10000 / n); round++)
+	{
+		vector<chrono::high_resolution_clock::time_point> sent(n);
+		for (int j = 0; j < n; j++)
+		{
+			sent[j] = chrono::high_resolution_clock::now();
+			bench[j]->cwrite(req.data(), len);
+		}
+		for (int j = 0; j < n; j++)
+		{
+			cread_full(bench[j], reply, chunk);
+			burst.push_back(chrono::duration<double, micro>(chrono::high_resolution_clock::now() - sent[j]).count());
+		}
+	}
+	print_latency("All channels at once", burst);
+	print_server_usage(server);
+}
+
+// A reply on its way from the workers to the histogram threads; person 0 tells a histogram thread to stop
+struct ecg_reply
+{
+	int person;
+	double value;
+};
+
+// What one pipeline thread did, kept by the thread itself and summed up per stage after the run
+struct thread_stats
+{
+	long items = 0;
+	double blocked_ms = 0;	// waiting on a full or empty buffer
+	double finished_ms = 0; // since the pipeline started
+};
+
+typedef chrono::steady_clock pipeline_clock;
+
+static double ms_since(pipeline_clock::time_point t)
+{
+	return chrono::duration<double, milli>(pipeline_clock::now() - t).count();
+}
+
+// Producer stage: pushes a request for the first d data points of one patient
+void request_producer(int person, int e, int d, BoundedBuffer<datamsg> *requests, thread_stats *stats, pipeline_clock::time_point start)
+{
+	for (int i = 0; i < d; i++)
+	{
+		auto before = pipeline_clock::now();
+		requests->push(datamsg(person, i * 0.004, e));
+		stats->blocked_ms += ms_since(before);
+		stats->items++;
+	}
+	stats->finished_ms = ms_since(start);
+}
+
+// Worker stage: does the round trip for every request it pops, over its own channel,
+// until it pops a QUIT_MSG
+void pipeline_worker(RequestChannel *chan, BoundedBuffer<datamsg> *requests, BoundedBuffer<ecg_reply> *replies, thread_stats *stats, pipeline_clock::time_point start)
+{
+	while (true)
+	{
+		auto before = pipeline_clock::now();
+		datamsg msg = requests->pop();
+		stats->blocked_ms += ms_since(before);
+		if (msg.mtype == QUIT_MSG)
+		{
+			break;
+		}
+		chan->cwrite(&msg, sizeof(datamsg));
+		double value;
+		cread_full(chan, &value, sizeof(double));
+
+		before = pipeline_clock::now();
+		replies->push(ecg_reply{msg.person, value});
+		stats->blocked_ms += ms_since(before);
+		stats->items++;
+	}
+	stats->finished_ms = ms_since(start);
+}
+
+// Histogram stage: counts every reply it pops into its own per-patient histograms
+void histogram_worker(BoundedBuffer<ecg_reply> *replies, vector<Histogram> *hists, thread_stats *stats, pipeline_clock::time_point start)
+{
+	while (true)
+	{
+		auto before = pipeline_clock::now();
+		ecg_reply reply = replies->pop();
+		stats->blocked_ms += ms_since(before);
+		if (reply.person == 0)
+		{
+			break;
+		}
+		(*hists)[reply.person - 1].update(reply.value);
+		stats->items++;
+	}
+	stats->finished_ms = ms_since(start);
+}
+
+// Prints the throughput of one stage and how much of its threads' time went to waiting
+// on a buffer; the stage that waits least is the bottleneck
+void print_stage(string label, vector<thread_stats> &stats)
+{
+	long items = 0;
+	double blocked = 0, finished = 0;
+	for (thread_stats &st : stats)
+	{
+		items += st.items;
+		blocked += st.blocked_ms;
+		finished = max(finished, st.finished_ms);
+	}
+	cout << "  " << label << ": " << stats.size() << " threads, " << items << " items in " << finished << " ms ("
+		 << (long)(items / max(finished, 1e-3) * 1000) << "/s), " << (int)(100 * blocked / max(finished * stats.size(), 1e-3))
+		 << "% of the time blocked on a buffer" << endl;
+}
+
+// -h: fetches the first d ecg e values of every patient in persons through a pipeline of one
+// producer thread per patient, w worker threads with a channel each and h histogram threads,
+// connected by bounded buffers of q items, and prints the per-patient histograms
+void run_pipeline(RequestChannel *control, char ipc, vector<RequestChannel *> &channels, vector<int> persons, int e, int d, int w, int h, int q)
+{
+	BoundedBuffer<datamsg> requests(q);
+	BoundedBuffer<ecg_reply> replies(q);
+	vector<RequestChannel *> wchans;
+	for (int j = 0; j < w; j++)
+	{
+		wchans.push_back(open_new_channel(control, ipc));
+		channels.push_back(wchans.back());
+	}
+
+	vector<thread_stats> pstats(persons.size()), wstats(w), hstats(h);
+	vector<vector<Histogram>> hists(h, vector<Histogram>(NUM_PERSONS, Histogram(ECG_HIST_BINS, ECG_HIST_START, ECG_HIST_END)));
+	auto start = pipeline_clock::now();
+
+	vector<thread> producers, workers, histograms;
+	for (size_t j = 0; j < persons.size(); j++)
+	{
+		producers.emplace_back(request_producer, persons[j], e, d, &requests, &pstats[j], start);
+	}
+	for (int j = 0; j < w; j++)
+	{
+		workers.emplace_back(pipeline_worker, wchans[j], &requests, &replies, &wstats[j], start);
+	}
+	for (int j = 0; j < h; j++)
+	{
+		histograms.emplace_back(histogram_worker, &replies, &hists[j], &hstats[j], start);
+	}
+
+	// Each stage is stopped once the one before it is done, with one marker per thread
+	for (thread &producer : producers)
+	{
+		producer.join();
+	}
+	datamsg quit(0, 0, 0);
+	quit.mtype = QUIT_MSG;
+	for (int j = 0; j < w; j++)
+	{
+		requests.push(quit);
+	}
+	for (thread &worker : workers)
+	{
+		worker.join();
+	}
+	for (int j = 0; j < h; j++)
+	{
+		replies.push(ecg_reply{0, 0});
+	}
+	for (thread &histogram : histograms)
+	{
+		histogram.join();
+	}
+	double total = ms_since(start);
+
+	vector<Histogram> merged(NUM_PERSONS, Histogram(ECG_HIST_BINS, ECG_HIST_START, ECG_HIST_END));
+	for (vector<Histogram> &local : hists)
+	{
+		for (int i = 0; i < NUM_PERSONS; i++)
+		{
+			merged[i].merge(local[i]);
+		}
+	}
+
+	cout << "ecg" << e << " histograms, " << ECG_HIST_BINS << " bins from " << ECG_HIST_START << " to " << ECG_HIST_END
+		 << ":" << endl;
+	for (int person : persons)
+	{
+		cout << "  " << person << ":";
+		for (int c : merged[person - 1].get())
+		{
+			cout << " " << c;
+		}
+		cout << " (" << merged[person - 1].count() << ")" << endl;
+	}
+
+	cout << "Pipeline of " << persons.size() * d << " requests, buffers of " << q << ", took " << total << " ms" << endl;
+	print_stage("producers", pstats);
+	print_stage("workers  ", wstats);
+	print_stage("histogram", hstats);
+}
+
 int main(int argc, char *argv[])
 {
 	int opt;
@@ -27,12 +409,25 @@ int main(int argc, char *argv[])
 	int e = -1;			 // ecg data type 1/2
 	int m = MAX_MESSAGE; // message
 	string filename = "";
-	vector<FIFORequestChannel *> channels;
+	char ipc = 'f';		 // transport: f (FIFO), s (shared memory), u (UNIX socket) or t (TCP loopback)
+	int w = 0;			 // number of worker channels for -f, 0 transfers over a single channel
+	int k = 1;			 // requests kept in flight per channel (pipelining window)
+	bool bflag = false;	 // fetch x1.csv with one BATCH_DATA_MSG instead of one request per value
+	bool zflag = false;	 // have the server send file chunks zero-copy (splice/sendfile)
+	bool sflag = false;	 // have the server stream the file instead of requesting every chunk
+	bool eflag = false;	 // have the server multiplex all channels on one epoll thread
+	bool Pflag = false;	 // have the server serve requests on a worker pool instead of the channel threads
+	bool Gflag = false;	 // like -P, with a pool that grows past one worker per core during a burst
+	int n = 0;			 // number of channels to open for the latency benchmark, 0 runs none
+	int h = 0;			 // histogram threads of the request pipeline, 0 runs no pipeline
+	int d = 1000;		 // data points per patient fetched by the pipeline
+	int q = 100;		 // capacity of the pipeline's buffers
+	vector<RequestChannel *> channels;
 	// Add other arguments here   |   Need to add -c, -m flags. BE CAREFUL OF getopt() NOTATION
 
 	bool cflag = false;
 
-	while ((opt = getopt(argc, argv, "p:t:e:f:m:c")) != -1)
+	while ((opt = getopt(argc, argv, "p:t:e:f:m:ci:w:k:bzsEPGn:h:d:q:")) != -1)
 	{
 		switch (opt)
 		{
@@ -55,9 +450,66 @@ int main(int argc, char *argv[])
 		case 'c':
 			cflag = true;
 			break;
+		case 'i':
+			ipc = optarg[0];
+			break;
+		case 'w':
+			w = atoi(optarg);
+			break;
+		case 'k':
+			k = atoi(optarg);
+			if (k <= 0)
+			{
+				cerr << "-k needs a window of at least 1 request" << endl;
+				return 1;
+			}
+			break;
+		case 'b':
+			bflag = true;
+			break;
+		case 'z':
+			zflag = true;
+			break;
+		case 's':
+			sflag = true;
+			break;
+		case 'E':
+			eflag = true;
+			break;
+		case 'P':
+			Pflag = true;
+			break;
+		case 'G':
+			Gflag = true;
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'h':
+			h = atoi(optarg);
+			break;
+		case 'd':
+			d = min(max(1, atoi(optarg)), 15000);
+			break;
+		case 'q':
+			q = atoi(optarg);
+			break;
 		}
 	}
 
+	if (eflag && ipc == 's')
+	{
+		// a shared memory channel has no descriptor the server could poll
+		cerr << "-E needs a transport the server can poll: -i f, u or t" << endl;
+		return 1;
+	}
+	if (bflag && p != -1 && (p < 1 || p > NUM_PERSONS))
+	{
+		// the server answers an unknown person with an empty batch, which -b would wait on forever
+		cerr << "-p must be a person between 1 and " << NUM_PERSONS << endl;
+		return 1;
+	}
+
 	// fork
 	// in the child, run execvp using the server
 
@@ -81,35 +533,64 @@ int main(int argc, char *argv[])
 	}
 	else if (pid1 == 0)
 	{
-		execl("./server", "./server", "-m", (to_string(m).c_str()), nullptr);
+		string mstr = to_string(m), istr(1, ipc);
+		vector<char *> args = {(char *)"./server", (char *)"-m", (char *)mstr.c_str(), (char *)"-i", (char *)istr.c_str()};
+		if (zflag)
+		{
+			args.push_back((char *)"-z");
+		}
+		if (eflag)
+		{
+			args.push_back((char *)"-E");
+		}
+		if (Pflag)
+		{
+			args.push_back((char *)"-P");
+		}
+		if (Gflag)
+		{
+			args.push_back((char *)"-G");
+		}
+		args.push_back(nullptr);
+		execv("./server", args.data());
 		perror("exec failed");
 		return 1;
 	}
-	// Set up FIFORequestChannel
-	FIFORequestChannel chan("control", FIFORequestChannel::CLIENT_SIDE);
-	channels.push_back(&chan);
+	// Set up the control channel over the transport selected with -i
+	RequestChannel *control = RequestChannel::create(ipc, "control", RequestChannel::CLIENT_SIDE);
+	channels.push_back(control);
 
 	// Task 4:
 	// Request a new channel (e.g. -c)
 	// Should use this new channel to communicate with server (still use control channel for sending QUIT_MSG)
 	if (cflag)
 	{
-		MESSAGE_TYPE msg = NEWCHANNEL_MSG;
-		// Write new channel message into pipe
-		chan.cwrite(&msg, sizeof(MESSAGE_TYPE));
-		// Read response from pipe (Can create any static sized char array that fits server response, e.g. MAX_MESSAGE)
-		char *newPipeName = new char[m];
-		chan.cread(newPipeName, sizeof(newPipeName));
-		// Create a new FIFORequestChannel object using the name sent by server
-		FIFORequestChannel* new_chan = new FIFORequestChannel(newPipeName, FIFORequestChannel::CLIENT_SIDE);
-		channels.push_back(new_chan);
+		channels.push_back(open_new_channel(control, ipc));
 	}
 
-	chan = *(channels.back());
+	RequestChannel &chan = *(channels.back());
+
+	if (n > 0)
+	{
+		channel_bench(control, ipc, n, channels, pid1);
+	}
 
 	// Task 2.1 + 2.2:
 	// Request data points
-	if (p != -1 && e != -1 && filename == "")
+	if (h > 0 && filename == "")
+	{
+		// Pipeline over every patient, or only over the one given with -p
+		vector<int> persons;
+		for (int i = 1; i <= NUM_PERSONS; i++)
+		{
+			if (p == -1 || p == i)
+			{
+				persons.push_back(i);
+			}
+		}
+		run_pipeline(control, ipc, channels, persons, e == -1 ? 1 : e, d, max(1, w), h, q);
+	}
+	else if (p != -1 && e != -1 && filename == "")
 	{
 		char buf[MAX_MESSAGE];
 		datamsg x(p, t, e); // Request patient data point
@@ -133,34 +614,46 @@ int main(int argc, char *argv[])
 			std::cerr << "Error opening file!" << std::endl;
 			return 1;
 		}
+		// Time is 0.004 second deviations
+		double times[1000];
 		t = 0.0;
-		// Iterate 1000 times
-		for (int i = 1; i <= 1000; i++)
-		{
-			// Write time into x1.csv (Time is 0.004 second deviations) TODO
-
-			datamsg msg = datamsg(p, t, 1);
-			// Write ecg1 datamsg into pipe
-			char buffer[MAX_MESSAGE];
-			memcpy(buffer, &msg, sizeof(datamsg));
-			chan.cwrite(buffer, sizeof(datamsg));
-			// Read response for ecg1 from pipe
-			double read1;
-			chan.cread(&read1, sizeof(double));
-
-			msg = datamsg(p, t, 2);
-			// Request ecg2 TODO
-			memcpy(buffer, &msg, sizeof(datamsg));
-			chan.cwrite(buffer, sizeof(datamsg));
-			// Read response for ecg1 from pipe
-			double read2;
-			chan.cread(&read2, sizeof(double));
-
-			ofs << t << ',' << read1 << ',' << read2 << endl;
-			// Increment time
+		for (int i = 0; i < 1000; i++)
+		{
+			times[i] = t;
 			t += 0.004;
 		}
 
+		double values[2000];
+		if (bflag)
+		{
+			// One request for the whole window, the reply is ecg1, ecg2 of every time in order
+			batchdatamsg msg(p, 0.0, 1000, 3);
+			chan.cwrite(&msg, sizeof(batchdatamsg));
+			cread_full(&chan, values, sizeof(values));
+		}
+		else
+		{
+			// Request 2 i is ecg1 and request 2 i + 1 is ecg2 of time i. Up to k
+			// requests are in flight and the replies come back in request order.
+			int window = clamp_window(&chan, k, sizeof(datamsg), sizeof(double));
+			int sent = 0;
+			for (int i = 0; i < 2000; i++)
+			{
+				while (sent < 2000 && sent - i < window)
+				{
+					datamsg msg = datamsg(p, times[sent / 2], sent % 2 + 1);
+					chan.cwrite(&msg, sizeof(datamsg));
+					sent++;
+				}
+				cread_full(&chan, &values[i], sizeof(double));
+			}
+		}
+
+		for (int i = 0; i < 1000; i++)
+		{
+			ofs << times[i] << ',' << values[2 * i] << ',' << values[2 * i + 1] << endl;
+		}
+
 		// CLOSE YOUR FILE TODO
 		ofs.close();
 	}
@@ -186,40 +679,55 @@ int main(int argc, char *argv[])
 		chan.cread(&file_length, sizeof(__int64_t));
 		cout << "The length of " << fname << " is " << file_length << endl;
 
-		// Set up output file under received folder TODO
-		// Can use any file opening method
-		ofstream ofs;
-		ofs.open("received/" + fname);
-
-		// if (!ofs.is_open())
-		// {
-		// 	std::cerr << "Error opening file!" << std::endl;
-		// 	return 1;
-		// }
-
-		// Request data chunks from server and output into file
-		// Loop from start of file to file_length
-		filemsg *freq = (filemsg *)buf2;
-		char *buf3 = new char[m];
-		for (int64_t i = 0; i < file_length; i += m)
-		{
-			// Create filemsg for data chunk range
-			// Assign data chunk range properly so that the data chunk to fetch from the file does NOT exceed the file length (i.e. take minimum between the two)
-			freq->offset = i;
-			freq->length = min((int64_t)m, file_length - i);
-			// Copy filemsg into buf2 buffer and write into pipe
-			// File name need not be re-copied into buf2, as filemsg struct object is staticly sized and therefore the file name is unchanged when filemsg is re-copied into buf2
-			chan.cwrite(buf2, len);
-			// Read data chunk response from server into separate data buffer
-			int read = chan.cread(buf3, freq->length);
-			// Write data chunk into new file
-			ofs.write(buf3, read);
+		// Set up output file under received folder, sized up front so chunks can be written at their offsets
+		int fd = open(("received/" + fname).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || ftruncate(fd, file_length) < 0)
+		{
+			EXITONERROR("received/" + fname);
+		}
+
+		int window = clamp_window(&chan, k, len, m);
+		if (w > 0)
+		{
+			// Task 3 with -w: every worker gets its own data channel and a disjoint,
+			// chunk-aligned range of the file. The server already serves each
+			// channel on its own thread.
+			__int64_t nchunks = (file_length + m - 1) / m;
+			vector<thread> workers;
+			for (int j = 0; j < w; j++)
+			{
+				RequestChannel *wchan = open_new_channel(control, ipc);
+				channels.push_back(wchan);
+				__int64_t start = min(file_length, nchunks * j / w * m);
+				__int64_t end = min(file_length, nchunks * (j + 1) / w * m);
+				if (sflag)
+				{
+					workers.emplace_back(stream_worker, wchan, fname, start, end, fd);
+				}
+				else
+				{
+					workers.emplace_back(file_worker, wchan, fname, start, end, m, window, fd);
+				}
+			}
+			for (thread &worker : workers)
+			{
+				worker.join();
+			}
+		}
+		else if (sflag)
+		{
+			// Let the server push the whole file over the one channel
+			stream_worker(&chan, fname, 0, file_length, fd);
+		}
+		else
+		{
+			// Request data chunks from server over the one channel and output into file
+			file_worker(&chan, fname, 0, file_length, m, window, fd);
 		}
 
 		// CLOSE YOUR FILE
-		ofs.close();
+		close(fd);
 		delete[] buf2;
-		delete[] buf3;
 
 		auto end_time = chrono::high_resolution_clock::now();
 		// Calculate the duration in milliseconds
@@ -228,16 +736,13 @@ int main(int argc, char *argv[])
 	}
 
 	// Task 5:
-	//  Closing all the channels
-	if (cflag)
+	//  Closing all the channels, the control channel last
+	MESSAGE_TYPE msg = QUIT_MSG;
+	while (!channels.empty())
 	{
-		while (!channels.empty())
-		{
-			FIFORequestChannel *temp = channels.back();
-			delete temp;
-			channels.pop_back();
-		}
+		RequestChannel *temp = channels.back();
+		temp->cwrite(&msg, sizeof(MESSAGE_TYPE));
+		delete temp;
+		channels.pop_back();
 	}
-	MESSAGE_TYPE msg = QUIT_MSG;
-	chan.cwrite(&msg, sizeof(MESSAGE_TYPE));
 }
\ No newline at end of file
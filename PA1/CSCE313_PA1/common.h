@@ -23,7 +23,7 @@ typedef char byte_t;
 
 
 // different types of messages
-enum MESSAGE_TYPE {UNKNOWN_MSG, DATA_MSG, FILE_MSG, NEWCHANNEL_MSG, QUIT_MSG};
+enum MESSAGE_TYPE {UNKNOWN_MSG, DATA_MSG, FILE_MSG, NEWCHANNEL_MSG, QUIT_MSG, BATCH_DATA_MSG, STREAM_FILE_MSG};
 
 
 // message requesting a data point
@@ -34,7 +34,7 @@ public:
     double seconds;
     int ecgno;
 
-    datamsg (int _person, double _seconds, int _eno) {
+    datamsg (int _person = 0, double _seconds = 0, int _eno = 0) {
         mtype = DATA_MSG;
         person = _person;
         seconds = _seconds;
@@ -43,6 +43,33 @@ public:
 };
 
 
+// message requesting count consecutive data points of one person, starting at
+// seconds. ecgmask picks the columns (bit 0: ecg1, bit 1: ecg2). The reply is
+// the selected values of those rows packed as double[], in row order, and stops
+// at the end of the recording. An unknown person, a start outside the recording
+// or any other bit in ecgmask gets an empty reply.
+class batchdatamsg {
+public:
+    MESSAGE_TYPE mtype;
+    int person;
+    double seconds;
+    int count;
+    int ecgmask;
+
+    batchdatamsg (int _person, double _seconds, int _count, int _ecgmask) {
+        mtype = BATCH_DATA_MSG;
+        person = _person;
+        seconds = _seconds;
+        count = _count;
+        ecgmask = _ecgmask;
+    }
+
+    int values_per_row () const {
+        return (ecgmask & 1) + ((ecgmask >> 1) & 1);
+    }
+};
+
+
 // message requesting a file
 class filemsg {
 public:
@@ -57,6 +84,24 @@ public:
     }
 };
 
+// message asking the server to push a whole byte range of a file; like filemsg
+// it is followed by the file name. length 0 means up to the end of the file.
+// The server first replies with the number of bytes it is going to send (an
+// __int64_t, 0 if the file cannot be opened), then sends them back to back in
+// frames of at most its buffer capacity, with no further requests needed.
+class streamfilemsg {
+public:
+    MESSAGE_TYPE mtype;
+    __int64_t offset;
+    __int64_t length;
+
+    streamfilemsg (__int64_t _offset, __int64_t _length) {
+        mtype = STREAM_FILE_MSG;
+        offset = _offset;
+        length = _length;
+    }
+};
+
 void EXITONERROR (std::string msg);
 std::vector<std::string> split (std::string line, char separator);
 __int64_t get_file_size (std::string filename);
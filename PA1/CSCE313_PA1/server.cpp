@@ -1,5 +1,14 @@
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <future>
+#include <set>
 #include <thread>
-#include "FIFORequestChannel.h"
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include "FileCache.h"
+#include "RequestChannel.h"
+#include "pool.h"
 
 using namespace std;
 
@@ -7,71 +16,340 @@ using namespace std;
 int buffercapacity = MAX_MESSAGE;
 char* buffer = NULL; // buffer used by the server, allocated in the main
 
+/* bytes read from a channel in one go; a pipelining client can have many
+requests queued, and they are all picked up by a single cread */
+const int inboxcapacity = 64 * MAX_MESSAGE;
+
+char ipcmethod = 'f'; // transport of every channel, selected with -i
+bool zerocopy = false; // serve file chunks with RequestChannel::csendfile, selected with -z
+
+/* -E mode: one thread multiplexes every channel with this epoll instance
+instead of one thread per channel; -1 in the default mode */
+int epollfd = -1;
+
+/* -E mode: replies queued past this many bytes hold back the channel's
+remaining requests until they are written, about what a pipe holds */
+const size_t outboxcapacity = 64 * 1024;
+
+/* -E mode: the channel as serve_requests sees it. A reply goes straight out
+when nothing is queued ahead of it, and whatever the channel does not take at
+once waits in outbox until it polls writable, so a client that is slow to read
+its replies holds up only itself. A streamed file is read one chunk at a time,
+each when the previous one has been written, so a client that stops reading
+costs the server at most a chunk. File chunks are copied into the outbox, -z
+does not apply to it. */
+class OutboxChannel : public RequestChannel {
+public:
+	RequestChannel* channel;
+	string outbox;
+	size_t sent = 0;		// bytes at the front of outbox already written
+	bool broken = false;	// a write failed, the client is gone
+
+	// the rest of the file being streamed, [stream_next, stream_end)
+	shared_ptr<OpenFile> stream_file;
+	__int64_t stream_next = 0, stream_end = 0;
+
+	OutboxChannel (RequestChannel* _channel) : RequestChannel(_channel->name(), SERVER_SIDE), channel(_channel) {}
+
+	int cread (void* msgbuf, int msgsize) override {
+		return channel->cread(msgbuf, msgsize);
+	}
+
+	int cwrite (void* msgbuf, int msgsize) override {
+		if (broken) {
+			errno = EPIPE;
+			return -1;
+		}
+		int nbytes = 0;
+		if (!queued()) {
+			nbytes = channel->cwrite_nonblocking(msgbuf, msgsize);
+			if (nbytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+				broken = true;
+				return -1;
+			}
+			nbytes = max(nbytes, 0);
+		}
+		outbox.append((char*) msgbuf + nbytes, msgsize - nbytes);
+		return msgsize;
+	}
+
+	bool queued () {
+		return sent < outbox.size();
+	}
+
+	/* True while the channel should not be given more requests: a file is
+	being streamed to it or too many replies are waiting. */
+	bool busy () {
+		return stream_file || outbox.size() - sent > outboxcapacity;
+	}
+
+	/* Streams [start, end) of file after whatever is queued. */
+	void stream (shared_ptr<OpenFile> file, __int64_t start, __int64_t end) {
+		if (start < end) {
+			stream_file = file;
+			stream_next = start;
+			stream_end = end;
+		}
+	}
+
+	/* Writes as much of the outbox as the channel takes now, reading the next
+	chunk of a streamed file whenever the outbox runs empty; false once a
+	write has failed. */
+	bool flush () {
+		while (true) {
+			while (queued()) {
+				int nbytes = channel->cwrite_nonblocking(&outbox[sent], outbox.size() - sent);
+				if (nbytes < 0) {
+					if (errno == EAGAIN || errno == EWOULDBLOCK) {
+						return true;
+					}
+					broken = true;
+					return false;
+				}
+				sent += nbytes;
+			}
+			outbox.clear();
+			sent = 0;
+			if (!stream_file) {
+				return true;
+			}
+
+			int length = min((__int64_t) buffercapacity, stream_end - stream_next);
+			outbox.resize(length);
+			int nbytes = pread(stream_file->fd, &outbox[0], length, stream_next);
+			if (nbytes != length) {
+				cerr << "Streaming to " << name() << " stopped at byte " << stream_next << endl;
+				outbox.clear();
+				stream_file.reset();
+				return true;
+			}
+			stream_next += length;
+			if (stream_next == stream_end) {
+				stream_file.reset();
+			}
+		}
+	}
+};
+
+/* what the event loop knows about a channel between two events: the requests
+not served yet, and the replies it has not taken yet */
+struct channel_state {
+	RequestChannel* channel;
+	std::string pending;
+	OutboxChannel replies;
+	bool writing = false;	// polled for room to write instead of for requests
+
+	channel_state (RequestChannel* _channel) : channel(_channel), replies(_channel) {}
+};
+set<channel_state*> watched_channels;
+
+/* -P mode: channel threads only read, the requests are served by this pool of
+one worker per core, so a burst of new channels cannot oversubscribe the CPU.
+With -G it may instead grow to 4 workers per core while a burst lasts and
+shrink back to one worker when idle. NULL in the default mode */
+ThreadPool* request_pool = NULL;
+atomic<int> pool_grown(0), pool_shrunk(0), pool_peak(0);	// resize events of request_pool
+
+/* open files shared by all channel threads, so a transfer opens its file once
+instead of once per chunk */
+FileCache file_cache(64);
+
 int nchannels = 0;
-vector<string> all_data[NUM_PERSONS];
+
+/* one patient's recording, parsed once at startup into one array per column;
+row i of every column is the sample at time i * 0.004 */
+struct patient_data {
+	vector<double> time;
+	vector<double> ecg1;
+	vector<double> ecg2;
+};
+patient_data all_data[NUM_PERSONS];
 
 
 // pre-declared because function signature required call in process_newchannel_request
-void handle_process_loop (FIFORequestChannel* _channel);
+void handle_process_loop (RequestChannel* _channel);
+void watch_channel (RequestChannel* _channel);
 
-void process_newchannel_request (FIFORequestChannel* _channel) {
+void process_newchannel_request (RequestChannel* _channel) {
 	nchannels++;
 	string new_channel_name = "data" + to_string(nchannels) + "_";
 	char buf[30];
 	strcpy(buf, new_channel_name.c_str());
 	_channel->cwrite(buf, new_channel_name.size()+1);
 
-	FIFORequestChannel* data_channel = new FIFORequestChannel(new_channel_name, FIFORequestChannel::SERVER_SIDE);
+	RequestChannel* data_channel = RequestChannel::create(ipcmethod, new_channel_name, RequestChannel::SERVER_SIDE);
+	if (epollfd >= 0) {
+		watch_channel(data_channel);
+		return;
+	}
 	thread thread_for_client(handle_process_loop, data_channel);
 	thread_for_client.detach();
 }
 
 
+/* Parses the decimal number at the start of [p, end) and stores where it stopped
+in *next. Numbers of up to 15 significant digits and a power of ten of at most
+22 are computed as one exact division or multiplication, which rounds the same
+way strtod does; anything else is handed over to strtod. Digits past the 15th
+are only counted, so the mantissa never overflows however long the field is. */
+static inline bool is_digit (char c) {
+	return isdigit((unsigned char) c);
+}
+
+double parse_number (const char* p, const char* end, const char** next) {
+	static const double powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+	const char* start = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = (*p == '-');
+		p++;
+	}
+
+	int64_t mantissa = 0;
+	int digits = 0;
+	int scale = 0;
+	for (; p < end && is_digit(*p); p++, digits++) {
+		if (digits < 15) {
+			mantissa = mantissa * 10 + (*p - '0');
+		}
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && is_digit(*p); p++, digits++, scale--) {
+			if (digits < 15) {
+				mantissa = mantissa * 10 + (*p - '0');
+			}
+		}
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char* exp = p + 1;
+		bool exp_negative = (exp < end && *exp == '-');
+		if (exp < end && (*exp == '-' || *exp == '+')) {
+			exp++;
+		}
+		if (exp < end && is_digit(*exp)) {
+			int e = 0;
+			for (; exp < end && is_digit(*exp); exp++) {
+				e = min(e * 10 + (*exp - '0'), 1000);
+			}
+			scale += exp_negative ? -e : e;
+			p = exp;
+		}
+	}
+	*next = p;
+
+	if (digits > 15 || scale < -22 || scale > 22) {
+		string text(start, p);
+		return strtod(text.c_str(), NULL);
+	}
+	double value = (double) mantissa;
+	value = (scale < 0) ? value / powers_of_ten[-scale] : value * powers_of_ten[scale];
+	return negative ? -value : value;
+}
+
+/* Maps BIMDC/<person>.csv and parses it straight out of the page cache into
+the columns of all_data[person-1]. Lines can be of any length, a missing final
+newline and CRLF line endings are fine, and empty lines are skipped. */
 void populate_file_data (int person) {
-	//cout << "populating for person " << person << endl;
 	string filename = "BIMDC/" + to_string(person) + ".csv";
-	char line[100];
-	ifstream ifs(filename.c_str());
-	if (ifs.fail()){
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
 		EXITONERROR("Data file: " + filename + " does not exist in the BIMDC/ directory");
 	}
-	
-	while (!ifs.eof()) {
-		line[0] = 0;
-		ifs.getline(line, 100);
-		if (ifs.eof()) {
-			break;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		EXITONERROR(filename);
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return;
+	}
+	char* data = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		EXITONERROR(filename);
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	const char* end = data + st.st_size;
+
+	// one pass over the newlines first, so every column is allocated exactly once
+	size_t lines = 1;
+	for (const char* p = data; (p = (const char*) memchr(p, '\n', end - p)); p++) {
+		lines++;
+	}
+	patient_data& pd = all_data[person-1];
+	pd.time.reserve(lines);
+	pd.ecg1.reserve(lines);
+	pd.ecg2.reserve(lines);
+
+	for (const char* p = data; p < end; ) {
+		const char* eol = (const char*) memchr(p, '\n', end - p);
+		if (!eol) {
+			eol = end;
 		}
-		
-		if (line[0]) {
-			all_data[person-1].push_back(string(line));
+		const char* line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+		if (line_end > p) {
+			// time,ecg1,ecg2
+			const char* field = p;
+			pd.time.push_back(parse_number(field, line_end, &field));
+			field += (field < line_end);
+			pd.ecg1.push_back(parse_number(field, line_end, &field));
+			field += (field < line_end);
+			pd.ecg2.push_back(parse_number(field, line_end, &field));
 		}
+		p = eol + 1;
+	}
+	munmap(data, st.st_size);
+}
+
+/* Loads every patient before the server accepts a connection. Patients are
+independent, so they are handed out to one loader thread per core. */
+int populate_all_data () {
+	int nthreads = max(1, min((int) thread::hardware_concurrency(), NUM_PERSONS));
+	atomic<int> next_person(1);
+	vector<thread> loaders;
+	for (int i = 0; i < nthreads; i++) {
+		loaders.emplace_back([&next_person] () {
+			int person;
+			while ((person = next_person++) <= NUM_PERSONS) {
+				populate_file_data(person);
+			}
+		});
+	}
+	for (thread& loader : loaders) {
+		loader.join();
 	}
+	return nthreads;
+}
+
+// resident set size of the server in KB, from /proc/self/statm
+long get_resident_memory () {
+	long pages = 0, resident = 0;
+	ifstream ifs("/proc/self/statm");
+	ifs >> pages >> resident;
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
 }
 
 double get_data_from_memory (int person, double seconds, int ecgno) {
 	int index = (int) round(seconds / 0.004);
-	string line = all_data[person-1][index]; 
-	vector<string> parts = split(line, ',');
-	
-	double ecg1 = stod(parts[1]);
-	double ecg2 = stod(parts[2]); 
 	if (ecgno == 1) {
-		return ecg1;
+		return all_data[person-1].ecg1[index];
 	}
 	else {
-		return ecg2;
+		return all_data[person-1].ecg2[index];
 	}
 }
 
-void process_file_request (FIFORequestChannel* rc, char* request) {
+void process_file_request (RequestChannel* rc, char* request) {
 	filemsg f = *((filemsg*) request);
 	string filename = request + sizeof(filemsg);
 	filename = "BIMDC/" + filename; // adding the path prefix to the requested file name
 	//cout << "Server received request for file " << filename << endl;
 
 	if (f.offset == 0 && f.length == 0) { // means that the client is asking for file size
-		__int64_t fs = get_file_size (filename);
+		// a new transfer starts with this, so make sure the cached stat is current
+		shared_ptr<OpenFile> file = file_cache.acquire(filename, true);
+		__int64_t fs = file ? (__int64_t) file->st.st_size : 0;
 		rc->cwrite ((char*) &fs, sizeof(__int64_t));
 		return;
 	}
@@ -85,16 +363,24 @@ void process_file_request (FIFORequestChannel* rc, char* request) {
 		cerr << "Client is requesting a chunk bigger than server's capacity" << endl;
 		cerr << "Returning nothing (i.e., 0 bytes) in response" << endl;
 		rc->cwrite(response, 0);
+		return;
 	}
 
-	FILE* fp = fopen(filename.c_str(), "rb");
-	if (!fp) {
+	shared_ptr<OpenFile> file = file_cache.acquire(filename);
+	if (!file) {
 		cerr << "Server received request for file: " << filename << " which cannot be opened" << endl;
 		rc->cwrite(buffer, 0);
 		return;
 	}
-	fseek(fp, f.offset, SEEK_SET);
-	int nbytes = fread(response, 1, f.length, fp);
+
+	if (zerocopy) {
+		int nbytes = rc->csendfile(file->fd, f.offset, f.length);
+		assert(nbytes == f.length);
+		return;
+	}
+
+	// pread leaves the shared descriptor's file offset alone
+	int nbytes = pread(file->fd, response, f.length, f.offset);
 
 	/* making sure that the client is asking for the right # of bytes,
 	this is especially imp for the last chunk of a file when the 
@@ -102,30 +388,110 @@ void process_file_request (FIFORequestChannel* rc, char* request) {
 	assert(nbytes == f.length); 
 
 	rc->cwrite(response, nbytes);
-	fclose(fp);
 }
 
-void process_data_request (FIFORequestChannel* rc, char* request) {
+void process_stream_file_request (RequestChannel* rc, char* request) {
+	streamfilemsg sf = *((streamfilemsg*) request);
+	string filename = "BIMDC/" + string(request + sizeof(streamfilemsg));
+	char* response = request;
+
+	shared_ptr<OpenFile> file = file_cache.acquire(filename, true);
+	__int64_t size = file ? (__int64_t) file->st.st_size : 0;
+	__int64_t start = min(max(sf.offset, (__int64_t) 0), size);
+	__int64_t end = (sf.length > 0) ? min(start + sf.length, size) : size;
+	__int64_t total = end - start;
+	rc->cwrite(&total, sizeof(__int64_t));
+	if (!file) {
+		cerr << "Server received request for file: " << filename << " which cannot be opened" << endl;
+		return;
+	}
+
+	// -E: the event loop reads each chunk once the client has taken the one before
+	OutboxChannel* outbox = dynamic_cast<OutboxChannel*>(rc);
+	if (outbox) {
+		outbox->stream(file, start, end);
+		return;
+	}
+
+	// the client drains whatever arrives, so frames go out without waiting for anything
+	for (__int64_t off = start; off < end; off += buffercapacity) {
+		int length = min((__int64_t) buffercapacity, end - off);
+		int nbytes;
+		if (zerocopy) {
+			nbytes = rc->csendfile(file->fd, off, length);
+		}
+		else {
+			nbytes = pread(file->fd, response, length, off);
+			if (nbytes > 0) {
+				nbytes = rc->cwrite(response, nbytes);
+			}
+		}
+		if (nbytes != length) {
+			cerr << "Streaming " << filename << " stopped at byte " << off << endl;
+			return;
+		}
+	}
+}
+
+void process_data_request (RequestChannel* rc, char* request) {
 	datamsg* d = (datamsg*) request;
 	double data = get_data_from_memory(d->person, d->seconds, d->ecgno);
 	rc->cwrite(&data, sizeof(double));
 }
 
-void process_unknown_request (FIFORequestChannel* rc) {
+void process_batch_data_request (RequestChannel* rc, char* request) {
+	batchdatamsg b = *((batchdatamsg*) request);
+	double row = round(b.seconds / 0.004);
+
+	// count comes from the client, so it is cut down to the rows that exist
+	size_t start = 0, count = 0;
+	if (b.person >= 1 && b.person <= NUM_PERSONS && (b.ecgmask & ~3) == 0) {
+		size_t rows = all_data[b.person-1].time.size();
+		if (row >= 0 && row <= (double) rows) {
+			start = (size_t) row;
+			count = min((size_t) max(0, b.count), rows - start);
+		}
+	}
+
+	vector<double> reply;
+	reply.reserve(count * b.values_per_row());
+	if (count > 0) {
+		const patient_data& data = all_data[b.person-1];
+		for (size_t index = start; index < start + count; index++) {
+			if (b.ecgmask & 1) {
+				reply.push_back(data.ecg1[index]);
+			}
+			if (b.ecgmask & 2) {
+				reply.push_back(data.ecg2[index]);
+			}
+		}
+	}
+	// may be bigger than buffercapacity, the client reads it until it has every value
+	rc->cwrite(reply.data(), reply.size() * sizeof(double));
+}
+
+void process_unknown_request (RequestChannel* rc) {
 	char a = 0;
 	rc->cwrite(&a, sizeof(char));
 }
 
 
-void process_request (FIFORequestChannel *rc, char* _request) {
+void process_request (RequestChannel *rc, char* _request) {
 	MESSAGE_TYPE m = *((MESSAGE_TYPE*) _request);
 	if (m == DATA_MSG) {
 		usleep(rand() % 5000);
 		process_data_request(rc, _request);
 	}
+	else if (m == BATCH_DATA_MSG) {
+		usleep(rand() % 5000);
+		process_batch_data_request(rc, _request);
+	}
 	else if (m == FILE_MSG) {
 		process_file_request(rc, _request);
 	}
+	else if (m == STREAM_FILE_MSG) {
+		process_stream_file_request(rc, _request);
+	}
 	else if (m == NEWCHANNEL_MSG) {
 		process_newchannel_request(rc);
 	}
@@ -134,16 +500,92 @@ void process_request (FIFORequestChannel *rc, char* _request) {
 	}
 }
 
-void handle_process_loop (FIFORequestChannel *channel) {
+/* Size of the request at the start of msg, or 0 if fewer than that many bytes
+have arrived yet. A request of unknown type takes up everything that was read. */
+int request_size (char* msg, int avail) {
+	if (avail < (int) sizeof(MESSAGE_TYPE)) {
+		return 0;
+	}
+	MESSAGE_TYPE m;
+	memcpy(&m, msg, sizeof(MESSAGE_TYPE)); // requests after a filemsg need not be aligned
+	if (m == DATA_MSG) {
+		return avail >= (int) sizeof(datamsg) ? sizeof(datamsg) : 0;
+	}
+	else if (m == BATCH_DATA_MSG) {
+		return avail >= (int) sizeof(batchdatamsg) ? sizeof(batchdatamsg) : 0;
+	}
+	else if (m == FILE_MSG || m == STREAM_FILE_MSG) {
+		int header = (m == FILE_MSG) ? sizeof(filemsg) : sizeof(streamfilemsg);
+		if (avail <= header) {
+			return 0;
+		}
+		char* end = (char*) memchr(msg + header, 0, avail - header);
+		return end ? end - msg + 1 : 0;
+	}
+	else if (m == NEWCHANNEL_MSG || m == QUIT_MSG) {
+		return sizeof(MESSAGE_TYPE);
+	}
+	return avail;
+}
+
+/* Serves every complete request in inbox[0, have) in the order they were sent
+and returns how many bytes they took up. Each request is copied into buffer
+first because the response is built in place of the request. Stops after a
+QUIT_MSG and sets quit, and in -E mode as soon as the channel is busy with the
+replies it has. */
+int serve_requests (RequestChannel* channel, char* inbox, int have, char* buffer, bool& quit) {
+	quit = false;
+	OutboxChannel* outbox = dynamic_cast<OutboxChannel*>(channel);
+	int pos = 0;
+	int size;
+	while ((!outbox || !outbox->busy()) && (size = request_size(inbox + pos, have - pos)) > 0) {
+		memcpy(buffer, inbox + pos, size);
+		pos += size;
+
+		MESSAGE_TYPE m = *((MESSAGE_TYPE*) buffer);
+		if (m == QUIT_MSG) {  // note that QUIT_MSG does not get a reply from the server
+			cout << "Client-side is done and exited" << endl;
+			quit = true;
+			break;
+		}
+		process_request(channel, buffer);
+	}
+	return pos;
+}
+
+/* Serves the requests picked up by one cread on a request_pool worker. The
+channel's thread waits for them before it reads again, so replies go out in
+the order the requests came in, and it owns inbox and buffer for that long.
+File transfers are queued behind data points and channel requests, so bulk
+transfers do not hold up the clients waiting on a single value. */
+int serve_on_pool (RequestChannel* channel, char* inbox, int have, char* buffer, bool& quit) {
+	MESSAGE_TYPE m;
+	memcpy(&m, inbox, sizeof(MESSAGE_TYPE));
+	bool bulk = (m == FILE_MSG || m == STREAM_FILE_MSG);
+	TaskOptions options{bulk ? "file requests" : "requests", bulk ? PRIORITY_LOW : PRIORITY_HIGH};
+	future<int> served = request_pool->Submit([=, &quit] {
+		return serve_requests(channel, inbox, have, buffer, quit);
+	}, options);
+	return served.get();
+}
+
+void handle_process_loop (RequestChannel *channel) {
 	/* creating a buffer per client to process incoming requests
 	and prepare a response */
-	char* buffer = new char[buffercapacity];
-	if (!buffer) {
+	char* buffer = new char[max(buffercapacity, inboxcapacity)];
+	char* inbox = new char[inboxcapacity];
+	if (!buffer || !inbox) {
 		EXITONERROR ("Cannot allocate memory for server buffer");
 	}
 
-	while (true) {
-		int nbytes = channel->cread(buffer, buffercapacity);
+	int have = 0; // bytes in inbox not yet taken apart into requests
+	bool done = false;
+	while (!done) {
+		if (have == inboxcapacity) {
+			cerr << "Client sent a request bigger than the server's inbox" << endl;
+			break;
+		}
+		int nbytes = channel->cread(inbox + have, inboxcapacity - have);
 		if (nbytes < 0) {
 			cerr << "Client-side terminated abnormally" << endl;
 			break;
@@ -152,35 +594,263 @@ void handle_process_loop (FIFORequestChannel *channel) {
 			cout << "Server could not read anything... Terminating" << endl;
 			break;
 		}
+		have += nbytes;
 
-		MESSAGE_TYPE m = *((MESSAGE_TYPE*) buffer);
-		if (m == QUIT_MSG) {  // note that QUIT_MSG does not get a reply from the server
-			cout << "Client-side is done and exited" << endl;
-			break;
+		int pos;
+		if (request_pool) {
+			pos = serve_on_pool(channel, inbox, have, buffer, done);
 		}
-		process_request(channel, buffer);
+		else {
+			pos = serve_requests(channel, inbox, have, buffer, done);
+		}
+		memmove(inbox, inbox + pos, have - pos);
+		have -= pos;
 	}
+	delete[] inbox;
 	delete[] buffer;
 	delete channel;
 }
 
+void watch_channel (RequestChannel* channel) {
+	if (channel->read_fd() < 0) {
+		cerr << "Channel " << channel->name() << " has no descriptor to poll, -E needs -i f, u or t" << endl;
+		exit(-1);
+	}
+	channel_state* state = new channel_state(channel);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = state;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, channel->read_fd(), &ev) < 0) {
+		EXITONERROR("epoll_ctl");
+	}
+	watched_channels.insert(state);
+}
+
+/* Switches a channel between being polled for requests and for room to write
+the replies queued for it. It is not read from again until they are all out,
+which bounds the queue at the replies to one inbox of requests. */
+void poll_writes (channel_state* state, bool writing) {
+	if (state->writing == writing) {
+		return;
+	}
+	state->writing = writing;
+	RequestChannel* channel = state->channel;
+	struct epoll_event ev;
+	ev.events = writing ? EPOLLOUT : EPOLLIN;
+	ev.data.ptr = state;
+	int ok;
+	if (channel->write_fd() == channel->read_fd()) {
+		ok = epoll_ctl(epollfd, EPOLL_CTL_MOD, channel->read_fd(), &ev);
+	}
+	else {	// a pipe pair: only one end is registered at a time
+		int from = writing ? channel->read_fd() : channel->write_fd();
+		int to = writing ? channel->write_fd() : channel->read_fd();
+		ok = epoll_ctl(epollfd, EPOLL_CTL_DEL, from, NULL);
+		if (ok == 0) {
+			ok = epoll_ctl(epollfd, EPOLL_CTL_ADD, to, &ev);
+		}
+	}
+	if (ok < 0) {
+		EXITONERROR("epoll_ctl");
+	}
+}
+
+void unwatch_channel (channel_state* state) {
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, state->channel->read_fd(), NULL);
+	if (state->channel->write_fd() != state->channel->read_fd()) {
+		epoll_ctl(epollfd, EPOLL_CTL_DEL, state->channel->write_fd(), NULL);
+	}
+	watched_channels.erase(state);
+	delete state->channel;
+	delete state;
+}
+
+/* Serves the requests in inbox[0, have), keeps what is left of them in the
+channel's state and polls the channel for what it waits on next: room for
+its replies while it is busy, requests otherwise. Returns true once the
+channel is done. */
+bool serve_channel (channel_state* state, char* inbox, int have, char* buffer) {
+	bool quit = false;
+	int pos = serve_requests(&state->replies, inbox, have, buffer, quit);
+	state->pending.assign(inbox + pos, have - pos);
+	if (quit) {
+		return true;
+	}
+	if (state->replies.broken) {
+		cerr << "Client-side terminated abnormally" << endl;
+		return true;
+	}
+	bool writing = state->replies.queued() || state->replies.busy();
+	if (!writing && (int) state->pending.size() == inboxcapacity) {
+		cerr << "Client sent a request bigger than the server's inbox" << endl;
+		return true;
+	}
+	poll_writes(state, writing);
+	return false;
+}
+
+/* -E mode: a single thread serves every channel. Each readable event gets one
+non-blocking cread, which is level-triggered and so fair between channels;
+anything left of a partial request is kept in the channel's state until the
+rest arrives. Replies are written without blocking too, and a channel that did
+not take all of them, or is being streamed a file, is polled for writing
+instead, with its remaining requests held back until it is done. Runs until
+the control channel quits. */
+void handle_event_loop (RequestChannel* control_channel) {
+	// a client that goes away shows up as EPIPE on its own channel
+	signal(SIGPIPE, SIG_IGN);
+	epollfd = epoll_create1(0);
+	if (epollfd < 0) {
+		EXITONERROR("epoll_create1");
+	}
+	watch_channel(control_channel);
+
+	char* buffer = new char[max(buffercapacity, inboxcapacity)];
+	char* inbox = new char[inboxcapacity];
+	struct epoll_event events[64];
+	bool done = false;
+	while (!done) {
+		int nevents = epoll_wait(epollfd, events, 64, -1);
+		if (nevents < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			EXITONERROR("epoll_wait");
+		}
+		for (int i = 0; i < nevents; i++) {
+			channel_state* state = (channel_state*) events[i].data.ptr;
+			int have = state->pending.size();
+			memcpy(inbox, state->pending.data(), have);
+			bool quit = false;
+
+			if (state->writing) {
+				if (!state->replies.flush()) {
+					cerr << "Client-side terminated abnormally" << endl;
+					quit = true;
+				}
+				else if (!state->replies.queued()) {
+					// everything is out, serve the requests that were held back
+					quit = serve_channel(state, inbox, have, buffer);
+				}
+			}
+			else {
+				int nbytes = state->channel->cread_nonblocking(inbox + have, inboxcapacity - have);
+				if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+					continue;
+				}
+				if (nbytes < 0) {
+					cerr << "Client-side terminated abnormally" << endl;
+					quit = true;
+				}
+				else if (nbytes == 0) {
+					cout << "Server could not read anything... Terminating" << endl;
+					quit = true;
+				}
+				else {
+					quit = serve_channel(state, inbox, have + nbytes, buffer);
+				}
+			}
+
+			if (quit) {
+				done = (state->channel == control_channel);
+				unwatch_channel(state);
+			}
+		}
+	}
+	// data channels whose clients never sent QUIT_MSG
+	while (!watched_channels.empty()) {
+		unwatch_channel(*watched_channels.begin());
+	}
+	close(epollfd);
+	delete[] inbox;
+	delete[] buffer;
+}
+
 int main (int argc, char *argv[]) {
 	buffercapacity = MAX_MESSAGE;
+	bool eventloop = false;
+	bool workerpool = false;
+	bool elastic = false;
 	int opt;
-	while ((opt = getopt(argc, argv, "m:")) != -1) {
+	while ((opt = getopt(argc, argv, "m:i:zEPG")) != -1) {
 		switch (opt) {
 			case 'm':
 				buffercapacity = atoi(optarg);
 				break;
+			case 'i':
+				ipcmethod = optarg[0];
+				break;
+			case 'z':
+				zerocopy = true;
+				break;
+			case 'E':
+				eventloop = true;
+				break;
+			case 'P':
+				workerpool = true;
+				break;
+			case 'G':   // -P with a pool that grows and shrinks
+				workerpool = true;
+				elastic = true;
+				break;
 		}
 	}
 
+	if (eventloop && ipcmethod == 's') {
+		cerr << "-E needs a transport that can be polled: -i f, u or t" << endl;
+		exit(-1);
+	}
+	if (eventloop && workerpool) {
+		cerr << "-E and -P are alternatives: the event loop already serves everything on one thread" << endl;
+		exit(-1);
+	}
+	if (elastic) {
+		/* requests spend most of their time sleeping (see process_data_request),
+		so the pool may grow well past one worker per core while a burst lasts */
+		PoolSize size;
+		size.max_threads = 4 * max(1u, thread::hardware_concurrency());
+		size.on_resize = [] (const ResizeEvent& e) {
+			(e.new_size > e.old_size ? pool_grown : pool_shrunk)++;
+			int peak = pool_peak.load();
+			while (e.new_size > peak && !pool_peak.compare_exchange_weak(peak, e.new_size));
+		};
+		request_pool = new ThreadPool(size);
+		pool_peak = request_pool->size();
+	}
+	else if (workerpool) {
+		request_pool = new ThreadPool(0);
+	}
+	if (request_pool) {
+		cout << "Serving requests on a pool of " << request_pool->size() << " to " << request_pool->max_size() << " workers" << endl;
+	}
+
 	srand(time_t(NULL));
+	long rss_before = get_resident_memory();
+	auto start_time = chrono::steady_clock::now();
+	int nloaders = populate_all_data();
+	auto duration = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start_time).count();
+	size_t rows = 0;
 	for (int i = 0; i < NUM_PERSONS; i++) {
-		populate_file_data(i+1);
+		rows += all_data[i].time.size();
 	}
+	cout << "Server startup: loaded " << rows << " rows of " << NUM_PERSONS << " patients in " << duration / 1000.0
+		<< " ms on " << nloaders << " threads, resident memory " << rss_before << " KB -> " << get_resident_memory() << " KB" << endl;
 	
-	FIFORequestChannel* control_channel = new FIFORequestChannel("control", FIFORequestChannel::SERVER_SIDE);
-	handle_process_loop(control_channel);
+	RequestChannel* control_channel = RequestChannel::create(ipcmethod, "control", RequestChannel::SERVER_SIDE);
+	if (eventloop) {
+		handle_event_loop(control_channel);
+	}
+	else {
+		handle_process_loop(control_channel);
+	}
+	if (request_pool) {
+		delete request_pool;   // finishes whatever is still queued, then joins the workers
+	}
+	if (elastic) {
+		cout << "Request pool: grew " << pool_grown << " times to at most " << pool_peak << " workers, shrank " << pool_shrunk << " times" << endl;
+	}
+	if (file_cache.hit_count() + file_cache.miss_count() > 0) {
+		cout << "File cache: " << file_cache.hit_count() << " hits, " << file_cache.miss_count() << " misses" << endl;
+	}
 	cout << "Server terminated" << endl;
 }
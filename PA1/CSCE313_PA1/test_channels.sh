@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# Usage: ./test_channels.sh [transport]
+# Opens 1000 and then 10000 data channels and compares the server's default
+# thread per channel with its -E event loop: server memory and thread count
+# with every channel open, and the p50/p99 latency of a small file request.
+# Defaults to UNIX sockets, since 10000 FIFO channels need more descriptors
+# than the usual limit (two per channel on each side).
+ipc=${1:-u}
+
+# Array of channel counts to test
+channel_counts=(1000 10000)
+
+for n in "${channel_counts[@]}"
+do
+    echo "Testing $n channels over -i $ipc"
+
+    for mode in "" "-E"
+    do
+        echo "  server ${mode:-(thread per channel)}:"
+        ./client -i $ipc $mode -n $n | grep -E "Opened|server V|server Threads|p50" | sed 's/^/    /'
+    done
+
+    echo "----------------------"
+done
@@ -1,5 +1,16 @@
 #!/bin/bash
 
+# Usage: ./test_sizes.sh ["client options" ...]
+# Transfers the same files once per set of client options given, so the
+# "Transfer Time" lines can be compared side by side, e.g.
+#   ./test_sizes.sh "-i f" "-i f -z" "-i t" "-i t -z"
+# compares the copying and the zero-copy server path. By default every
+# transport is compared.
+configs=("$@")
+if [ ${#configs[@]} -eq 0 ]; then
+    configs=("-i f" "-i s" "-i u" "-i t")
+fi
+
 # Array of file sizes to test (in bytes)
 file_sizes=(1000 10000 100000 1000000 10000000 100000000)
 
@@ -14,20 +25,23 @@ bimdc_file="BIMDC/temp_file.csv"
 for size in "${file_sizes[@]}"
 do
     echo "Testing file size: $size bytes"
-    
+
     # Copy original file to temp file
     cp "$original_file" "$bimdc_file"
-    
+
     # Truncate the temp file to the desired size
     truncate -s $size "$bimdc_file"
-    
-    # Run the client with the temp file and capture the output
-    output=$(./client -f "temp_file.csv")
-    
-    echo "$output"
-    
+
+    for config in "${configs[@]}"
+    do
+        # Run the client with the temp file and capture the output
+        output=$(./client -f "temp_file.csv" $config | grep "Transfer Time")
+
+        echo "  $config: $output"
+    done
+
     echo "----------------------"
-    
+
     # Clean up the temp file
     rm "$bimdc_file"
-done
\ No newline at end of file
+done
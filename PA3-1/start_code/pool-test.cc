@@ -1,28 +1,429 @@
 #include "pool.h"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
 #include <iostream>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
 #include <vector>
 
+// counts every allocation, to check what submitting a task costs
+static std::atomic<long> allocations{0};
+
+void *operator new(size_t n) {
+    allocations++;
+    void *p = malloc(n ? n : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
 struct EmptyTask : Task {
     void Run() override {
         std::this_thread::sleep_for(std::chrono::seconds(2));
     }
 };
 
+// Records how long it waited between SubmitTask and Run.
+struct TimedTask : Task {
+    TimedTask(std::vector<double> &latencies, int i, std::atomic<int> &finished)
+        : latencies(latencies), i(i), finished(finished), submitted(std::chrono::steady_clock::now()) {}
+
+    void Run() override {
+        latencies[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - submitted).count();
+        finished++;
+    }
+
+    std::vector<double> &latencies;
+    int i;
+    std::atomic<int> &finished;
+    std::chrono::steady_clock::time_point submitted;
+};
+
+static double cpu_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Submits n tasks, waiting gap_us between two submissions (0 submits them all
+// at once), and prints the submit-to-start latencies. Returns false if not
+// every task ran.
+static bool latency_test(ThreadPool &pool, const char *label, int n, int gap_us) {
+    std::vector<double> latencies(n);
+    std::atomic<int> finished{0};
+    for (int i = 0; i < n; i++) {
+        pool.SubmitTask("timed", new TimedTask(latencies, i, finished));
+        if (gap_us > 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(gap_us));
+        }
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (finished.load() < n && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (finished.load() < n) {
+        std::cout << label << ": only " << finished.load() << " of " << n << " tasks ran" << std::endl;
+        return false;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << label << ": " << n << " tasks, submit to start p50 " << latencies[n / 2]
+              << " us, p99 " << latencies[n * 99 / 100] << " us, max " << latencies[n - 1] << " us" << std::endl;
+    return true;
+}
+
+// Submit(), Post() and WaitAll(). Returns false on the first thing that is wrong.
+static bool submit_test(ThreadPool &pool) {
+    if (pool.Submit([] { return 6 * 7; }, "answer").get() != 42) {
+        std::cout << "Submit: wrong result" << std::endl;
+        return false;
+    }
+    try {
+        pool.Submit([]() -> int { throw std::runtime_error("from a task"); }).get();
+        std::cout << "Submit: exception was lost" << std::endl;
+        return false;
+    } catch (const std::runtime_error &) {
+    }
+    std::array<char, 256> big{};  // too big to be stored inline
+    big[255] = 7;
+    if (pool.Submit([big] { return big[255]; }).get() != 7) {
+        std::cout << "Submit: wrong result from a large callable" << std::endl;
+        return false;
+    }
+
+    // every task also posts a subtask, WaitAll() has to wait for those too
+    std::atomic<int> ran{0};
+    for (int i = 0; i < 10000; i++) {
+        pool.Post([&pool, &ran] {
+            ran++;
+            pool.Post([&ran] { ran++; });
+        });
+    }
+    pool.WaitAll();
+    if (ran.load() != 20000) {
+        std::cout << "WaitAll: returned after " << ran.load() << " of 20000 tasks" << std::endl;
+        return false;
+    }
+
+    // once the pool has InlineTasks to recycle, Post() allocates nothing and
+    // Submit() only what its std::promise does: the shared state and the result
+    const int n = 1000;
+    long before = allocations.load();
+    for (int i = 0; i < n; i++) {
+        pool.Post([&ran] { ran++; });
+    }
+    pool.WaitAll();
+    double per_post = (double) (allocations.load() - before) / n;
+    std::vector<std::future<int>> futures;
+    futures.reserve(n);
+    before = allocations.load();
+    for (int i = 0; i < n; i++) {
+        futures.push_back(pool.Submit([i] { return i; }));
+    }
+    pool.WaitAll();
+    double per_submit = (double) (allocations.load() - before) / n;
+    for (int i = 0; i < n; i++) {
+        if (futures[i].get() != i) {
+            std::cout << "Submit: wrong result " << i << std::endl;
+            return false;
+        }
+    }
+    std::cout << "allocations: " << per_post << " per Post, " << per_submit << " per Submit" << std::endl;
+    if (per_post != 0) {
+        std::cout << "Post: a small callable allocated" << std::endl;
+        return false;
+    }
+    if (per_submit > 2) {
+        std::cout << "Submit: allocated more than its promise" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Sums fib(n) out of leaves, every task above a leaf posting its two halves
+// from inside the pool, so they go to the worker's own deque.
+static void fib_task(ThreadPool &pool, int n, std::atomic<long> &sum) {
+    if (n < 2) {
+        sum += n;
+        return;
+    }
+    pool.Post([&pool, n, &sum] { fib_task(pool, n - 1, sum); });
+    pool.Post([&pool, n, &sum] { fib_task(pool, n - 2, sum); });
+}
+
+// Subtasks pushed to a worker's deque: recursive ones all run, and one whose
+// parent keeps its worker busy until it has run can only be stolen.
+static bool stealing_test() {
+    ThreadPool pool{4};
+    std::atomic<long> sum{0};
+    pool.Post([&pool, &sum] { fib_task(pool, 20, sum); });
+    pool.WaitAll();
+    if (sum.load() != 6765) {
+        std::cout << "subtasks: fib(20) came out as " << sum.load() << std::endl;
+        return false;
+    }
+
+    ThreadPool pair{2};
+    std::atomic<bool> ran{false};
+    std::thread::id parent, child;
+    pair.Post([&pair, &ran, &parent, &child] {
+        parent = std::this_thread::get_id();
+        pair.Post([&ran, &child] {
+            child = std::this_thread::get_id();
+            ran = true;
+        });
+        // the subtask is on our deque; only the other worker can take it from there
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (!ran.load() && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::yield();
+        }
+    });
+    pair.WaitAll();
+    if (!ran.load() || parent == child) {
+        std::cout << "stealing: the subtask was not stolen by the idle worker" << std::endl;
+        return false;
+    }
+    std::cout << "subtasks: fib(20) out of " << 2 * 10946 - 1 << " recursive tasks, and one stolen by the idle worker"
+              << std::endl;
+    return true;
+}
+
+// Runs the tasks posted by fill() on a single worker, in the order the pool
+// picks them, and returns that order.
+static std::string run_order(const std::function<void(ThreadPool &, std::string &)> &fill) {
+    ThreadPool pool{1};
+    std::string order;
+    std::atomic<bool> gate{false};
+    // keep the worker busy until everything is queued
+    pool.Post([&gate] {
+        while (!gate.load()) {
+            std::this_thread::yield();
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    fill(pool, order);
+    gate = true;
+    pool.WaitAll();
+    return order;
+}
+
+// Priorities, starvation protection and deadlines.
+static bool priority_test() {
+    std::string order = run_order([](ThreadPool &pool, std::string &order) {
+        for (int i = 0; i < 20; i++) {
+            pool.Post([&order] { order += 'L'; }, TaskOptions{"low", PRIORITY_LOW});
+        }
+        for (int i = 0; i < 40; i++) {
+            pool.Post([&order] { order += 'H'; }, TaskOptions{"high", PRIORITY_HIGH});
+        }
+    });
+    std::cout << "priorities: 20 low then 40 high ran as " << order << std::endl;
+    if (order[0] != 'H' || order.find('L') >= (size_t) ThreadPool::kStarvationLimit) {
+        std::cout << "priorities: high did not go first, or low starved" << std::endl;
+        return false;
+    }
+
+    // the worker is held up past the deadline, so the task has to be dropped
+    std::future<void> late;
+    long expired = 0;
+    order = run_order([&late, &expired](ThreadPool &pool, std::string &order) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(1);
+        late = pool.Submit([&order] { order += 'X'; }, TaskOptions{"late", PRIORITY_NORMAL, deadline});
+        pool.Post([&pool, &expired] { expired = pool.expired_count(); }, TaskOptions{"check", PRIORITY_LOW});
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    });
+    bool broken = false;
+    try {
+        late.get();
+    } catch (const std::future_error &) {
+        broken = true;
+    }
+    if (!order.empty() || !broken || expired != 1) {
+        std::cout << "deadlines: task past its deadline was not dropped" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// A task removed while queued is dropped unrun; removing one that has already
+// run and been deleted, or removing twice, does nothing.
+static bool remove_test() {
+    struct AppendTask : Task {
+        AppendTask(std::string &order, char c) : order(order), c(c) {}
+        void Run() override { order += c; }
+        std::string &order;
+        char c;
+    };
+    ThreadPool pool{1};
+    std::string order;
+    std::atomic<bool> gate{false};
+    // keep the worker busy until both are queued
+    pool.Post([&gate] {
+        while (!gate.load()) {
+            std::this_thread::yield();
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    uint64_t kept = pool.SubmitTask("kept", new AppendTask(order, 'K'));
+    uint64_t removed = pool.SubmitTask("removed", new AppendTask(order, 'R'));
+    bool first = pool.remove_task(removed);
+    bool again = pool.remove_task(removed);
+    gate = true;
+    pool.WaitAll();
+    bool late = pool.remove_task(kept);
+    if (order != "K" || !first || again || late) {
+        std::cout << "remove_task: ran \"" << order << "\", removed " << first << ", again " << again
+                  << ", after running " << late << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Latency of a trickle of urgent tasks while the workers are flooded with
+// bulk tasks that each take 100 us.
+static void mixed_test(Priority bulk, Priority urgent, const char *label) {
+    ThreadPool pool{4};
+    for (int i = 0; i < 2000; i++) {
+        pool.Post([] {
+            auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(100);
+            while (std::chrono::steady_clock::now() < end) {
+            }
+        }, TaskOptions{"bulk", bulk});
+    }
+    const int n = 100;
+    std::vector<double> latencies(n);
+    std::atomic<int> finished{0};
+    for (int i = 0; i < n; i++) {
+        Task *task = new TimedTask(latencies, i, finished);
+        task->priority = urgent;
+        pool.SubmitTask("urgent", task);
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    pool.WaitAll();
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << label << ": urgent task submit to start p50 " << latencies[n / 2] << " us, p99 "
+              << latencies[n * 99 / 100] << " us" << std::endl;
+}
+
+// Pinned pools still run everything, and each worker is confined to the CPUs
+// its affinity mode gives it.
+static bool affinity_test(Affinity affinity, const char *label) {
+    ThreadPool pool{4, 4096, affinity};
+    const CpuTopology &topo = pool.topology();
+    std::atomic<int> wrong{0};
+    for (int i = 0; i < 1000; i++) {
+        pool.Post([&pool, &topo, &wrong] {
+            int cpu = sched_getcpu();
+            bool allowed = false;
+            for (int index = 0; index < pool.size(); index++) {
+                allowed = allowed || (cpu >= 0 && topo.node_of(cpu) == pool.node_of_worker(index));
+            }
+            if (!allowed) {
+                wrong++;
+            }
+        });
+    }
+    pool.WaitAll();
+    std::cout << label << ": " << topo.cpus.size() << " cpus on " << topo.num_nodes() << " node(s), "
+              << wrong.load() << " tasks ran off their workers' nodes" << std::endl;
+    return wrong.load() == 0;
+}
+
+// A burst of slow tasks grows an elastic pool, which shrinks back to its
+// minimum once it has been idle for a while, and then sleeps like a fixed one.
+static bool elastic_test() {
+    std::mutex mtx;
+    std::vector<ResizeEvent> events;
+    PoolSize size;
+    size.min_threads = 1;
+    size.max_threads = 8;
+    size.grow_depth = 16;
+    size.grow_wait = std::chrono::microseconds(500);
+    size.idle_timeout = std::chrono::milliseconds(100);
+    size.on_resize = [&mtx, &events](const ResizeEvent &e) {
+        std::lock_guard<std::mutex> lock(mtx);
+        events.push_back(e);
+    };
+    ThreadPool pool{size};
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 400; i++) {
+        pool.Post([] { std::this_thread::sleep_for(std::chrono::milliseconds(1)); });
+    }
+    pool.WaitAll();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    int peak = pool.size();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    // the worker left cannot retire, it must not spin on its idle timeout either
+    double before = cpu_ms();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    double idle = cpu_ms() - before;
+
+    std::lock_guard<std::mutex> lock(mtx);
+    int grown = 0, shrunk = 0;
+    for (const ResizeEvent &e: events) {
+        peak = std::max(peak, e.new_size);
+        (e.new_size > e.old_size ? grown : shrunk)++;
+    }
+    std::cout << "elastic: 400 x 1 ms tasks in " << ms << " ms, grew " << grown << " times to " << peak
+              << " workers, shrank " << shrunk << " times to " << pool.size() << ", then " << idle
+              << " ms of CPU in 500 ms idle" << std::endl;
+    return peak > 1 && pool.size() == 1 && grown == shrunk && idle < 50;
+}
+
 int main(int argc, char **argv) {
-    ThreadPool pool{5};
-    
-    auto *et1 = new EmptyTask();
-    pool.SubmitTask("first", et1);
+    {
+        ThreadPool pool{5};
 
-    std::this_thread::sleep_for(std::chrono::milliseconds (500));
+        auto *et1 = new EmptyTask();
+        pool.SubmitTask("first", et1);
 
-    auto *et2 = new EmptyTask();
-    pool.SubmitTask("second", et2);
+        std::this_thread::sleep_for(std::chrono::milliseconds (500));
 
+        auto *et2 = new EmptyTask();
+        pool.SubmitTask("second", et2);
+
+        pool.Stop();
+    }
+
+    ThreadPool pool{4};
+    bool ok = latency_test(pool, "spaced out", 2000, 200);
+    ok = latency_test(pool, "burst", 5000, 0) && ok;
+    ok = submit_test(pool) && ok;
+    ok = stealing_test() && ok;
+    ok = priority_test() && ok;
+    ok = remove_test() && ok;
+    ok = affinity_test(AFFINITY_CORE, "pinned to cores") && ok;
+    ok = affinity_test(AFFINITY_NODE, "pinned to nodes") && ok;
+    ok = elastic_test() && ok;
+    mixed_test(PRIORITY_NORMAL, PRIORITY_NORMAL, "bulk and urgent at the same priority");
+    mixed_test(PRIORITY_LOW, PRIORITY_HIGH, "bulk low, urgent high");
+
+    // idle workers must not burn the CPU
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    double before = cpu_ms();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    std::cout << "idle: " << cpu_ms() - before << " ms of CPU in 500 ms with " << pool.size() << " workers" << std::endl;
+
+    auto start = std::chrono::steady_clock::now();
     pool.Stop();
-    return 0;
+    std::cout << "Stop: " << std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count()
+              << " us to wake and join the idle workers" << std::endl;
+    return ok ? 0 : 1;
 }
-
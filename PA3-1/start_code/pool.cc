@@ -1,60 +1,435 @@
 #include "pool.h"
+#include <algorithm>
 #include <mutex>
 #include <iostream>
+#include <random>
+#include <climits>
+#include <cerrno>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 Task::Task() = default;
 Task::~Task() = default;
 
-ThreadPool::ThreadPool(int num_threads) {
-    for (int i = 0; i < num_threads; i++) {
-        threads.emplace_back(new std::thread(&ThreadPool::run_thread, this));
+void Task::Dispose() {
+    delete this;
+}
+
+void InlineTask::Dispose() {
+    destroy(target);
+    target = nullptr;
+    name = nullptr;
+    running = false;
+    priority = PRIORITY_NORMAL;
+    deadline = kNoDeadline;
+    if (!pool->free_inline_tasks.try_push(this)) {
+        delete this;
     }
 }
 
+static void futex_wait(std::atomic<uint32_t> *word, uint32_t expected, const timespec *timeout = NULL) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static void futex_wake(std::atomic<uint32_t> *word, int nwaiters) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE_PRIVATE, nwaiters, NULL, NULL, 0);
+}
+
+// Which pool and worker the current thread is, so SubmitTask can tell a
+// subtask from a task submitted from outside.
+static thread_local ThreadPool *current_pool = nullptr;
+static thread_local int current_worker = -1;
+
+static PoolSize fixed_size(int num_threads) {
+    PoolSize size;
+    size.min_threads = size.max_threads = num_threads;
+    return size;
+}
+
+ThreadPool::ThreadPool(int num_threads, size_t queue_capacity, Affinity affinity)
+    : ThreadPool(fixed_size(num_threads), queue_capacity, affinity) {}
+
+ThreadPool::ThreadPool(const PoolSize &size, size_t queue_capacity, Affinity affinity)
+    : sizing(size), topo(CpuTopology::discover()), affinity(affinity) {
+    // hardware_concurrency() is 0 when unknown, and unsigned
+    int cores = (int) std::min(std::max(1u, std::thread::hardware_concurrency()), 4096u);
+    int max_threads = sizing.max_threads > 0 ? sizing.max_threads : cores;
+    sizing.max_threads = max_threads;
+    sizing.min_threads = std::min(std::max(sizing.min_threads, 1), max_threads);
+    elastic = sizing.min_threads < max_threads;
+    size_t num_threads = (size_t) max_threads;  // slots, at least one
+    num_queue_nodes = affinity == AFFINITY_NONE ? 1 : topo.num_nodes();
+    for (int i = 0; i < num_queue_nodes * NUM_PRIORITIES; i++) {
+        queues.emplace_back(new MPMCRing<Task *>(queue_capacity));
+    }
+    for (size_t i = 0; i < num_threads; i++) {
+        if (affinity == AFFINITY_CORE) {
+            worker_node.push_back(topo.node_of(topo.cpus[i % topo.cpus.size()]));
+        } else if (affinity == AFFINITY_NODE) {
+            worker_node.push_back((int) (i % (size_t) topo.num_nodes()));
+        } else {
+            worker_node.push_back(0);
+        }
+    }
+    spin_rounds = cores > 1 ? 64 : 0;
+    // every deque exists before any worker can go looking for one to steal from
+    for (size_t i = 0; i < num_threads * NUM_PRIORITIES; i++) {
+        deques.emplace_back(new WorkStealingDeque<Task *>());
+    }
+    slot_busy.reset(new std::atomic<bool>[num_threads]());
+    threads.resize(num_threads, nullptr);
+    for (int i = 0; i < sizing.min_threads; i++) {
+        slot_busy[i] = true;
+        num_live++;
+        used_slots++;
+        threads[i] = new std::thread(&ThreadPool::run_thread, this, i);
+    }
+    last_grow = std::chrono::steady_clock::now();
+    last_progress = now_ns();
+}
+
 ThreadPool::~ThreadPool() {
+    Stop();
     for (std::thread *t: threads) {
         delete t;
     }
     threads.clear();
 
-    for (Task *q: queue) {
-        delete q;
+    Task *q;
+    for (auto &queue: queues) {
+        while (queue->try_pop(q)) {
+            q->Dispose();
+        }
+    }
+    for (auto &deque: deques) {
+        while (deque->steal(q)) {
+            q->Dispose();
+        }
+    }
+    // last, the tasks disposed above may have been put back here
+    InlineTask *t;
+    while (free_inline_tasks.try_pop(t)) {
+        delete t;
     }
-    queue.clear();
 }
 
-void ThreadPool::SubmitTask(const std::string &name, Task *task) {
-    //TODO: Add task to queue, make sure to lock the queue
+uint64_t ThreadPool::SubmitTask(const std::string &name, Task *task) {
+    task->owned_name = name;
+    task->name = task->owned_name.c_str();
+    uint64_t id;
+    {
+        std::lock_guard<std::mutex> lock(pending_mtx);
+        id = task->id = ++last_task_id;
+        pending.insert(id);
+    }
+    enqueue(task);
+    return id;
 }
 
-void ThreadPool::run_thread() {
-    while (true) {
+bool ThreadPool::claim(Task *task) {
+    if (task->id == 0) {
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(pending_mtx);
+    return pending.erase(task->id) == 1;
+}
 
-        //TODO1: if done and no tasks left, break
+InlineTask *ThreadPool::acquire_inline_task() {
+    InlineTask *task;
+    if (!free_inline_tasks.try_pop(task)) {
+        task = new InlineTask(this);
+    }
+    return task;
+}
 
-        //TODO2: if no tasks left, continue
+void ThreadPool::enqueue(Task *task) {
+    // counted before it is visible, or a thief could finish a subtask and let
+    // WaitAll() return while its parent is still running
+    outstanding++;
+    int64_t queued_at = 0;  // the task may be gone by the time we look at the sizing
+    if (elastic) {
+        task->queued_at = std::chrono::steady_clock::now();
+        queued_at = std::chrono::duration_cast<std::chrono::nanoseconds>(task->queued_at.time_since_epoch()).count();
+    }
+    int level = std::min(std::max((int) task->priority, 0), NUM_PRIORITIES - 1);
+    if (current_pool == this) {
+        deques[current_worker * NUM_PRIORITIES + level]->push(task);
+    } else if (!queues[submit_node() * NUM_PRIORITIES + level]->try_push(task)) {
+        claim(task);  // nobody has the id yet to remove it with
+        task->running = true;
+        task->Run();
+        finished(task);
+        return;
+    }
+    int waiting = num_tasks_unserviced++;
+    // For a subtask the one woken is a thief, the submitter runs it otherwise.
+    wake(1);
 
-       
-        //TODO3: get task from queue, remove it from queue, and run it
+    if (elastic && num_live.load() < sizing.max_threads) {
+        if (waiting <= 0) {
+            last_progress = queued_at;
+        } else if (waiting >= sizing.grow_depth) {
+            maybe_grow("queue depth");
+        } else if (queued_at - last_progress.load() > std::chrono::nanoseconds(sizing.grow_wait).count()) {
+            maybe_grow("queue wait");
+        }
+    }
+}
 
-        //TODO4: delete task
+void ThreadPool::maybe_grow(const char *reason) {
+    std::unique_lock<std::mutex> lock(mtx, std::try_to_lock);
+    if (!lock.owns_lock() || stopped) {
+        return;  // someone else is adding one right now
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_grow < sizing.grow_wait || num_live.load() >= sizing.max_threads) {
+        return;
+    }
+    // a retiring worker gives up its place in num_live before its slot
+    int index = 0;
+    while (index < sizing.max_threads && slot_busy[index].load()) {
+        index++;
     }
+    if (index == sizing.max_threads) {
+        return;
+    }
+    if (threads[index]) {
+        threads[index]->join();  // a retired worker, already on its way out
+        delete threads[index];
+    }
+    slot_busy[index] = true;
+    int old_size = num_live++;
+    if (index >= used_slots.load()) {
+        used_slots = index + 1;
+    }
+    threads[index] = new std::thread(&ThreadPool::run_thread, this, index);
+    last_grow = now;
+    lock.unlock();
+    report(old_size, old_size + 1, reason);
 }
 
-// Remove Task t from queue if it's there
-void ThreadPool::remove_task(Task *t) {
-    mtx.lock();
-    for (auto it = queue.begin(); it != queue.end();) {
-        if (*it == t) {
-            queue.erase(it);
-            mtx.unlock();
-            return;
+bool ThreadPool::retire() {
+    int n = num_live.load();
+    while (n > sizing.min_threads) {
+        if (num_live.compare_exchange_weak(n, n - 1)) {
+            report(n, n - 1, "idle");
+            return true;
         }
-        ++it;
     }
-    mtx.unlock();
+    return false;
+}
+
+void ThreadPool::report(int old_size, int new_size, const char *reason) {
+    if (sizing.on_resize) {
+        sizing.on_resize(ResizeEvent{old_size, new_size, reason});
+    }
+}
+
+void ThreadPool::wake(int nworkers) {
+    // A worker about to park bumps num_sleeping before its last look at
+    // num_tasks_unserviced, so either it sees the new task or we see it here.
+    // If it reads wake_seq before our bump, the futex wait returns at once.
+    if (num_sleeping.load() > 0) {
+        wake_seq.fetch_add(1);
+        futex_wake(&wake_seq, nworkers);
+    }
+}
+
+void ThreadPool::finished(Task *task) {
+    task->Dispose();
+    // the same handshake as wake(), with WaitAll() bumping num_waiting
+    if (outstanding.fetch_sub(1) == 1 && num_waiting.load() > 0) {
+        futex_wake(&outstanding, INT_MAX);
+    }
+}
+
+void ThreadPool::WaitAll() {
+    num_waiting++;
+    uint32_t n;
+    while ((n = outstanding.load()) != 0) {
+        futex_wait(&outstanding, n);
+    }
+    num_waiting--;
+}
+
+bool ThreadPool::park(std::chrono::steady_clock::time_point idle_since) {
+    num_sleeping++;
+    uint32_t seq = wake_seq.load();
+    if (!done.load() && num_tasks_unserviced.load() <= 0) {
+        if (!elastic) {
+            futex_wait(&wake_seq, seq);
+        } else {
+            auto left = idle_since + sizing.idle_timeout - std::chrono::steady_clock::now();
+            if (left > left.zero()) {
+                long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+                timespec timeout{ns / 1000000000, ns % 1000000000};
+                futex_wait(&wake_seq, seq, &timeout);
+            }
+        }
+    }
+    num_sleeping--;
+    return elastic && std::chrono::steady_clock::now() - idle_since >= sizing.idle_timeout;
+}
+
+Task *ThreadPool::find_task_at(int index, int level) {
+    Task *task;
+    if (deques[index * NUM_PRIORITIES + level]->pop(task)) {
+        return task;
+    }
+    // own node's queue first; the others too, so nothing is stranded on a node without workers
+    int node = worker_node[index];
+    for (int i = 0; i < num_queue_nodes; i++) {
+        int n = (node + i) % num_queue_nodes;
+        if (queues[n * NUM_PRIORITIES + level]->try_pop(task)) {
+            return task;
+        }
+    }
+    // start at a random victim so thieves spread out instead of all hitting worker 0;
+    // victims on the same node first, their tasks' data is more likely in a shared cache
+    static thread_local std::minstd_rand rng(index + 1);
+    int n = used_slots.load();
+    int start = (int) (rng() % n);
+    for (int same_node = 1; same_node >= 0; same_node--) {
+        for (int i = 0; i < n; i++) {
+            int victim = (start + i) % n;
+            if (victim != index && (worker_node[victim] == node) == (bool) same_node
+                && deques[victim * NUM_PRIORITIES + level]->steal(task)) {
+                return task;
+            }
+        }
+    }
+    return nullptr;
+}
+
+Task *ThreadPool::find_task(int index, bool lowest_first) {
+    for (int i = 0; i < NUM_PRIORITIES; i++) {
+        Task *task = find_task_at(index, lowest_first ? NUM_PRIORITIES - 1 - i : i);
+        if (task) {
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+Task *ThreadPool::next_task(int index, bool lowest_first) {
+    Task *task;
+    while ((task = find_task(index, lowest_first))) {
+        num_tasks_unserviced--;
+        if (elastic) {
+            auto now = std::chrono::steady_clock::now();
+            last_progress = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+            if (now - task->queued_at > sizing.grow_wait && num_live.load() < sizing.max_threads) {
+                maybe_grow("queue wait");
+            }
+        }
+        bool expired = task->deadline != kNoDeadline && std::chrono::steady_clock::now() > task->deadline;
+        if (expired) {
+            num_expired++;
+        }
+        if (!claim(task) || expired) {
+            finished(task);
+            continue;
+        }
+        return task;
+    }
+    return nullptr;
+}
+
+int ThreadPool::submit_node() {
+    if (num_queue_nodes == 1) {
+        return 0;
+    }
+    return std::min(topo.current_node(), num_queue_nodes - 1);
+}
+
+void ThreadPool::pin(int index) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (affinity == AFFINITY_CORE) {
+        CPU_SET(topo.cpus[index % topo.cpus.size()], &set);
+    } else {
+        for (int cpu: topo.node_cpus[worker_node[index]]) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+void ThreadPool::run_thread(int index) {
+    if (affinity != AFFINITY_NONE) {
+        pin(index);
+    }
+    current_pool = this;
+    current_worker = index;
+    int idle_rounds = 0;
+    unsigned picks = 0;
+    auto idle_since = std::chrono::steady_clock::now();
+    while (true) {
+        Task *task = next_task(index, ++picks % kStarvationLimit == 0);
+        if (!task) {
+            // only leave once everything is drained, tasks submitted before Stop() still run
+            if (num_tasks_unserviced.load() <= 0 && done.load()) {
+                break;
+            }
+            if (idle_rounds++ < spin_rounds) {
+                std::this_thread::yield();
+            } else {
+                // Out of num_sleeping before looking at num_tasks_unserviced: a
+                // task submitted after the look wakes or finds another worker.
+                // Our deque is empty, only we push to it.
+                if (park(idle_since)) {
+                    if (num_tasks_unserviced.load() <= 0 && retire()) {
+                        break;
+                    }
+                    // kept, at min_threads: sleep out another idle_timeout before asking again
+                    idle_since = std::chrono::steady_clock::now();
+                }
+                idle_rounds = 0;
+            }
+            continue;
+        }
+        idle_rounds = 0;
+
+        task->running = true;
+        task->Run();
+        task->running = false;
+        finished(task);
+        if (elastic) {
+            idle_since = std::chrono::steady_clock::now();
+        }
+    }
+    current_pool = nullptr;
+    current_worker = -1;
+    slot_busy[index] = false;
+}
+
+// The queues cannot give up an element from the middle, so the task only
+// loses its claim and the worker that pops it drops it
+bool ThreadPool::remove_task(uint64_t id) {
+    std::lock_guard<std::mutex> lock(pending_mtx);
+    return pending.erase(id) == 1;
 }
 
 void ThreadPool::Stop() {
-    //TODO: Delete threads, but remember to wait for them to finish first
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (stopped) {
+            return;
+        }
+        stopped = true;
+        done = true;
+    }
+    wake(INT_MAX);
+    // nothing is added once stopped is set, and retired workers have exited or are about to
+    for (std::thread *t: threads) {
+        if (t) {
+            t->join();
+        }
+    }
 }
@@ -1,10 +1,45 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <new>
 #include <string>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
 #include <thread>
 #include <vector>
 #include <mutex>
 #include <condition_variable>
 #include <semaphore>
 
+#include "ring.h"
+#include "topology.h"
+#include "wsdeque.h"
+
+class ThreadPool;
+
+// Every level has its own queues. Workers take the highest level that has
+// work, except that every kStarvationLimit-th pick looks at the levels the
+// other way round, so a steady stream of high priority work cannot starve the
+// low priority work completely.
+enum Priority { PRIORITY_HIGH, PRIORITY_NORMAL, PRIORITY_LOW, NUM_PRIORITIES };
+
+// Where workers may run. AFFINITY_CORE pins worker i to the i-th usable CPU
+// (wrapping around), AFFINITY_NODE lets worker i run on any CPU of NUMA node
+// i % nodes. With either one, a task submitted from outside the pool is queued
+// for the node the submitting thread is running on, and workers look at their
+// own node's queues and deques before the others'.
+enum Affinity { AFFINITY_NONE, AFFINITY_CORE, AFFINITY_NODE };
+
+typedef std::chrono::steady_clock::time_point Deadline;
+static const Deadline kNoDeadline = Deadline::max();
+
 class Task {
 public:
     Task();
@@ -14,30 +49,273 @@ public:
     virtual void Run() = 0;  // implemented by subclass
     bool is_running() const { return running; }
 
-    std::string name;
+    // Called by the pool once the task has run or was removed; deletes it
+    // unless the subclass recycles it.
+    virtual void Dispose();
+
+    // Optional, for debugging. Submit() only stores the pointer, so it has to
+    // outlive the task (a string literal does); SubmitTask() keeps a copy.
+    const char *name = nullptr;
     bool running = false;
+
+    // Set before submitting. A task still queued at its deadline is dropped
+    // without running, like a removed one.
+    Priority priority = PRIORITY_NORMAL;
+    Deadline deadline = kNoDeadline;
+
+private:
+    friend class ThreadPool;
+    std::string owned_name;
+    std::chrono::steady_clock::time_point queued_at;  // only set by an elastic pool
+    uint64_t id = 0;  // what SubmitTask() returned, 0 for Post() and Submit()
+};
+
+// How Submit() and Post() queue a task.
+struct TaskOptions {
+    const char *name = nullptr;
+    Priority priority = PRIORITY_NORMAL;
+    Deadline deadline = kNoDeadline;
+};
+
+// A worker was added to or retired from an elastic pool. reason is "queue
+// depth", "queue wait" or "idle".
+struct ResizeEvent {
+    int old_size;
+    int new_size;
+    const char *reason;
+};
+
+// Elastic sizing. The pool starts min_threads workers and adds one more, up to
+// max_threads, when a submission finds more than grow_depth tasks waiting, or
+// when a task is found to have waited longer than grow_wait (checked by the
+// worker that takes it, and by submissions while nothing has been taken for
+// that long). At most one worker is added per grow_wait, so that it gets a
+// chance to drain the backlog first. A worker that found nothing to do for
+// idle_timeout exits, as long as min_threads stay. on_resize, if set, is
+// called after every change, from the thread that made it.
+struct PoolSize {
+    int min_threads = 1;
+    int max_threads = 0;  // 0 or less: one per core
+    int grow_depth = 64;
+    std::chrono::microseconds grow_wait{1000};
+    std::chrono::milliseconds idle_timeout{2000};
+    std::function<void(const ResizeEvent &)> on_resize;
+};
+
+// The task Submit() and Post() wrap a callable in. A callable of up to
+// kInlineSize bytes is constructed inside the task itself, and the pool keeps
+// finished InlineTasks for reuse, so submitting a small lambda does not
+// allocate. Larger callables are moved to the heap.
+class InlineTask : public Task {
+public:
+    static constexpr size_t kInlineSize = 64;
+
+    explicit InlineTask(ThreadPool *pool) : pool(pool) {}
+
+    template <class F>
+    void emplace(F &&f) {
+        using Fn = std::decay_t<F>;
+        if constexpr (sizeof(Fn) <= kInlineSize && alignof(Fn) <= alignof(std::max_align_t)) {
+            target = new (storage) Fn(std::forward<F>(f));
+            destroy = [](void *p) { static_cast<Fn *>(p)->~Fn(); };
+        } else {
+            target = new Fn(std::forward<F>(f));
+            destroy = [](void *p) { delete static_cast<Fn *>(p); };
+        }
+        invoke = [](void *p) { (*static_cast<Fn *>(p))(); };
+    }
+
+    void Run() override { invoke(target); }
+
+    // Destroys the callable and hands the task back to its pool.
+    void Dispose() override;
+
+private:
+    ThreadPool *pool;
+    alignas(std::max_align_t) unsigned char storage[kInlineSize];
+    void *target = nullptr;
+    void (*invoke)(void *) = nullptr;
+    void (*destroy)(void *) = nullptr;
 };
 
 class ThreadPool {
 public:
-    explicit ThreadPool(int num_threads);
+    // Starts num_threads workers; 0 or less means one per core. At most
+    // queue_capacity tasks submitted from outside the pool wait at a time, per
+    // priority (and per node when pinned).
+    explicit ThreadPool(int num_threads, size_t queue_capacity = 4096, Affinity affinity = AFFINITY_NONE);
+
+    // An elastic pool, sized between size.min_threads and size.max_threads.
+    explicit ThreadPool(const PoolSize &size, size_t queue_capacity = 4096, Affinity affinity = AFFINITY_NONE);
 
+    // Stops the pool if Stop() has not been called yet.
     ~ThreadPool();
 
-    // Submit a task with a particular name.
-    void SubmitTask(const std::string &name, Task *task);
-    void remove_task(Task *t);
+    // Submit a task with a particular name. The pool owns the task from here on
+    // and deletes it once it has run. A task submitted by one of the pool's own
+    // workers goes to that worker's deque, where it runs next unless an idle
+    // worker steals it first. Anything else goes to the shared queue; when that
+    // is full the task is run right away on the calling thread, which slows
+    // down the submitter instead of growing the queue. Returns the id
+    // remove_task() takes.
+    uint64_t SubmitTask(const std::string &name, Task *task);
+
+    // Runs f() on the pool, queued the same way as SubmitTask, and returns a
+    // future for its result or exception. If the task misses its deadline,
+    // get() throws std::future_error (broken_promise). The task itself does
+    // not allocate (see InlineTask); std::promise does, for the future's
+    // shared state and its result (two allocations with libstdc++).
+    template <class F>
+    auto Submit(F &&f, const char *name = nullptr) -> std::future<std::invoke_result_t<std::decay_t<F> &>> {
+        return Submit(std::forward<F>(f), TaskOptions{name});
+    }
+
+    template <class F>
+    auto Submit(F &&f, const TaskOptions &options) -> std::future<std::invoke_result_t<std::decay_t<F> &>> {
+        using R = std::invoke_result_t<std::decay_t<F> &>;
+        std::promise<R> promise;
+        std::future<R> future = promise.get_future();
+        Post([promise = std::move(promise), f = std::forward<F>(f)]() mutable {
+            try {
+                if constexpr (std::is_void_v<R>) {
+                    f();
+                    promise.set_value();
+                } else {
+                    promise.set_value(f());
+                }
+            } catch (...) {
+                promise.set_exception(std::current_exception());
+            }
+        }, options);
+        return future;
+    }
+
+    // Like Submit() without a future, for fire-and-forget work: no allocation
+    // at all once the pool has InlineTasks to recycle. An exception thrown by f
+    // terminates the program.
+    template <class F>
+    void Post(F &&f, const char *name = nullptr) {
+        Post(std::forward<F>(f), TaskOptions{name});
+    }
+
+    template <class F>
+    void Post(F &&f, const TaskOptions &options) {
+        InlineTask *task = acquire_inline_task();
+        task->emplace(std::forward<F>(f));
+        task->name = options.name;
+        task->priority = options.priority;
+        task->deadline = options.deadline;
+        enqueue(task);
+    }
+
+    // Blocks until every task submitted so far has run, including the
+    // subtasks they submit. Not to be called from inside a task.
+    void WaitAll();
+
+    // Make sure the task SubmitTask() returned id for is not run if it is
+    // still waiting in a queue. The pool still deletes it when it comes out of
+    // the queue. Returns false if it was already taken to run, or removed.
+    // Ids are never reused and the task is never touched, so a late call is
+    // harmless however long ago the task finished.
+    bool remove_task(uint64_t id);
 
     // Stop all threads. All tasks must have been waited for before calling this.
     // You may assume that SubmitTask() is not caled after this is called.
     void Stop();
 
-    void run_thread();
+    void run_thread(int index);
+
+    // Workers running right now; changes over time for an elastic pool.
+    int size() const { return num_live.load(); }
+    int max_size() const { return sizing.max_threads; }
+
+    const CpuTopology &topology() const { return topo; }
+
+    // NUMA node worker index (below max_size()) runs on, always 0 without affinity.
+    int node_of_worker(int index) const { return worker_node[index]; }
+
+    // Tasks dropped because they were still queued at their deadline.
+    long expired_count() const { return num_expired.load(); }
 
-    int num_tasks_unserviced = 0;
+    static const int kStarvationLimit = 8;
+
+    std::atomic<int> num_tasks_unserviced{0};
 private:
-    std::mutex mtx;
-    std::vector<std::thread *> threads;
-    std::vector<Task *> queue;
-    volatile bool done = false;
+    friend class InlineTask;
+
+    void enqueue(Task *task);
+    void finished(Task *task);
+
+    // The ids of SubmitTask() tasks that are queued and not removed. A worker
+    // claims a task before it runs or drops it; false if remove_task() took
+    // it off first.
+    bool claim(Task *task);
+    std::mutex pending_mtx;
+    std::unordered_set<uint64_t> pending;
+    uint64_t last_task_id = 0;  // under pending_mtx
+
+    // Elastic sizing, see PoolSize. Workers live in slots 0 to max_threads - 1,
+    // whose deques and nodes are all set up front so that nothing a thief
+    // reads is ever reallocated; a retired worker's slot is reused by the next
+    // one added. used_slots is one past the highest slot ever started.
+    PoolSize sizing;
+    bool elastic;
+    void maybe_grow(const char *reason);
+    bool retire();
+    void report(int old_size, int new_size, const char *reason);
+    std::atomic<int> num_live{0};
+    std::atomic<int> used_slots{0};
+    std::unique_ptr<std::atomic<bool>[]> slot_busy;
+    std::chrono::steady_clock::time_point last_grow;  // under mtx
+    // last time a task was taken, or the queues went from empty to not empty:
+    // the oldest waiting task has waited at least since then
+    std::atomic<int64_t> last_progress{0};
+
+    InlineTask *acquire_inline_task();
+    MPMCRing<InlineTask *> free_inline_tasks{1024};
+
+    // tasks submitted and not yet finished, WaitAll() parks on it
+    alignas(64) std::atomic<uint32_t> outstanding{0};
+    std::atomic<int> num_waiting{0};
+
+    // Next task for worker index that has not been removed or expired, or
+    // nullptr. Per level: its own deque first, then the shared queue, then the
+    // other workers' deques. With lowest_first the levels are scanned from
+    // PRIORITY_LOW up.
+    Task *next_task(int index, bool lowest_first);
+    Task *find_task(int index, bool lowest_first);
+    Task *find_task_at(int index, int level);
+
+    CpuTopology topo;
+    Affinity affinity;
+    int num_queue_nodes;  // nodes with their own queues: topo's nodes when pinned, else 1
+    std::vector<int> worker_node;
+    void pin(int index);
+    int submit_node();  // node whose queues a task from the calling thread goes to
+
+    // tasks submitted from outside the pool, the queue for priority p on node n
+    // is queues[n * NUM_PRIORITIES + p]
+    std::vector<std::unique_ptr<MPMCRing<Task *>>> queues;
+    // worker i's deque for priority p is deques[i * NUM_PRIORITIES + p]
+    std::vector<std::unique_ptr<WorkStealingDeque<Task *>>> deques;
+    std::atomic<long> num_expired{0};
+
+    // Idle workers first look for work for spin_rounds rounds (none on a single
+    // core, where spinning only delays the thread that would submit), then park
+    // on a futex on wake_seq. A submission bumps wake_seq and wakes one of them,
+    // but only when one is actually parked.
+    // Returns true if the worker has now been idle since idle_since for longer
+    // than the elastic idle_timeout.
+    bool park(std::chrono::steady_clock::time_point idle_since);
+    void wake(int nworkers);
+    int spin_rounds;
+    alignas(64) std::atomic<uint32_t> wake_seq{0};
+    std::atomic<int> num_sleeping{0};
+
+    std::mutex mtx;  // for Stop() and adding workers
+    std::vector<std::thread *> threads;  // by slot, nullptr for one never started
+    std::atomic<bool> done{false};
+    bool stopped = false;
 };
+
+#endif
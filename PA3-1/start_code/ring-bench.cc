@@ -0,0 +1,97 @@
+#include "ring.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Moves the same number of items through each queue with P producer and C
+// consumer threads and prints millions of items per second. A push into a
+// full queue or a pop from an empty one yields and retries, for every queue.
+//
+// Usage: ./ring-bench [total items, default 2000000]
+
+// The baseline: what ThreadPool used before, a vector under one mutex,
+// popped from the front.
+class MutexVectorQueue {
+public:
+    explicit MutexVectorQueue(size_t capacity) : capacity(capacity) {}
+
+    bool try_push(const long &item) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (items.size() >= capacity) {
+            return false;
+        }
+        items.push_back(item);
+        return true;
+    }
+
+    bool try_pop(long &item) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (items.empty()) {
+            return false;
+        }
+        item = items.front();
+        items.erase(items.begin());
+        return true;
+    }
+
+private:
+    size_t capacity;
+    std::mutex mtx;
+    std::vector<long> items;
+};
+
+static const size_t kCapacity = 1024;
+
+template <class Q>
+double run(int producers, int consumers, long total) {
+    Q queue(kCapacity);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int p = 0; p < producers; p++) {
+        long n = total / producers + (p == 0 ? total % producers : 0);
+        threads.emplace_back([&queue, n] {
+            for (long i = 0; i < n; i++) {
+                while (!queue.try_push(i)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (int c = 0; c < consumers; c++) {
+        long n = total / consumers + (c == 0 ? total % consumers : 0);
+        threads.emplace_back([&queue, n] {
+            long item;
+            for (long i = 0; i < n; i++) {
+                while (!queue.try_pop(item)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (std::thread &t: threads) {
+        t.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return total / seconds / 1e6;
+}
+
+int main(int argc, char **argv) {
+    long total = argc > 1 ? atol(argv[1]) : 2000000;
+    printf("%ld items, capacity %zu, %u cores, Mitems/s\n", total, kCapacity, std::thread::hardware_concurrency());
+    printf("%10s %10s %12s %12s %12s\n", "producers", "consumers", "mutex+vector", "MPMCRing", "SPSCRing");
+
+    int shapes[][2] = {{1, 1}, {2, 2}, {4, 4}, {8, 8}, {16, 16}, {32, 32}, {64, 64}, {1, 64}, {64, 1}};
+    for (auto &shape: shapes) {
+        int p = shape[0], c = shape[1];
+        printf("%10d %10d %12.2f %12.2f", p, c, run<MutexVectorQueue>(p, c, total), run<MPMCRing<long>>(p, c, total));
+        if (p == 1 && c == 1) {
+            printf(" %12.2f", run<SPSCRing<long>>(p, c, total));
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,140 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Bounded lock-free queues of default-constructible, copyable T. Neither one
+// ever blocks: try_push fails when the ring is full and try_pop fails when it
+// is empty, and callers decide whether to retry, yield or sleep. The capacity
+// is rounded up to a power of two.
+
+static inline size_t ring_capacity(size_t capacity) {
+    size_t c = 2;
+    while (c < capacity) {
+        c <<= 1;
+    }
+    return c;
+}
+
+// Multi-producer/multi-consumer ring (Dmitry Vyukov's design). Every cell has
+// a sequence number telling whose turn it is: a producer may fill cell i when
+// its seq equals the enqueue position, a consumer may empty it when seq equals
+// the dequeue position + 1. Producers and consumers only contend on their own
+// position counter, with a single compare-exchange per operation.
+template <class T>
+class MPMCRing {
+public:
+    explicit MPMCRing(size_t capacity)
+        : mask(ring_capacity(capacity) - 1), cells(new Cell[mask + 1]) {
+        for (size_t i = 0; i <= mask; i++) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool try_push(const T &item) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells[pos & mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+            if (dif == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.data = item;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;  // full
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T &item) {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells[pos & mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+            if (dif == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    item = cell.data;
+                    cell.seq.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;  // empty
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    const size_t mask;
+    std::unique_ptr<Cell[]> cells;
+    alignas(64) std::atomic<size_t> enqueue_pos{0};
+    alignas(64) std::atomic<size_t> dequeue_pos{0};
+};
+
+// Single-producer/single-consumer ring. head and tail are only ever written by
+// one side each, so there is no compare-exchange at all; each side also keeps
+// a cached copy of the other side's counter and only reloads it (pulling the
+// cache line over) when the ring looks full or empty.
+template <class T>
+class SPSCRing {
+public:
+    explicit SPSCRing(size_t capacity)
+        : mask(ring_capacity(capacity) - 1), data(new T[mask + 1]) {}
+
+    // Only to be called from the producer thread.
+    bool try_push(const T &item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head_cache > mask) {
+            head_cache = head.load(std::memory_order_acquire);
+            if (t - head_cache > mask) {
+                return false;  // full
+            }
+        }
+        data[t & mask] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Only to be called from the consumer thread.
+    bool try_pop(T &item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail_cache) {
+            tail_cache = tail.load(std::memory_order_acquire);
+            if (h == tail_cache) {
+                return false;  // empty
+            }
+        }
+        item = data[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+private:
+    const size_t mask;
+    std::unique_ptr<T[]> data;
+    alignas(64) std::atomic<size_t> head{0};  // written by the consumer
+    size_t tail_cache = 0;                    // consumer's last look at tail
+    alignas(64) std::atomic<size_t> tail{0};  // written by the producer
+    size_t head_cache = 0;                    // producer's last look at head
+};
+
+#endif
@@ -0,0 +1,110 @@
+#include "topology.h"
+
+#include <dirent.h>
+#include <sched.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+static std::string read_line(const std::string &path) {
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+std::vector<int> CpuTopology::parse_cpu_list(const std::string &list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || !isdigit((unsigned char) range[0])) {
+            continue;
+        }
+        size_t dash = range.find('-');
+        int first = atoi(range.c_str());
+        int last = dash == std::string::npos ? first : atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+CpuTopology CpuTopology::discover() {
+    CpuTopology topo;
+
+    // online CPUs that the affinity mask we were started with allows
+    std::vector<int> online = parse_cpu_list(read_line("/sys/devices/system/cpu/online"));
+    if (online.empty()) {
+        for (unsigned i = 0; i < std::max(1u, std::thread::hardware_concurrency()); i++) {
+            online.push_back(i);
+        }
+    }
+    cpu_set_t allowed;
+    bool have_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    for (int cpu: online) {
+        if (!have_mask || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))) {
+            topo.cpus.push_back(cpu);
+        }
+    }
+    if (topo.cpus.empty()) {
+        topo.cpus.push_back(0);
+    }
+    topo.cpu_node.assign(topo.cpus.back() + 1, -1);
+
+    std::vector<int> node_ids;
+    if (DIR *dir = opendir("/sys/devices/system/node")) {
+        while (dirent *entry = readdir(dir)) {
+            if (strncmp(entry->d_name, "node", 4) == 0 && isdigit((unsigned char) entry->d_name[4])) {
+                node_ids.push_back(atoi(entry->d_name + 4));
+            }
+        }
+        closedir(dir);
+    }
+    std::sort(node_ids.begin(), node_ids.end());
+    for (int node: node_ids) {
+        std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+        std::vector<int> mine;
+        for (int cpu: parse_cpu_list(read_line(path))) {
+            if (cpu < (int) topo.cpu_node.size() && std::find(topo.cpus.begin(), topo.cpus.end(), cpu) != topo.cpus.end()) {
+                mine.push_back(cpu);
+            }
+        }
+        if (mine.empty()) {
+            continue;  // memory-only node, or none of its CPUs are ours
+        }
+        for (int cpu: mine) {
+            topo.cpu_node[cpu] = topo.num_nodes();
+        }
+        topo.node_cpus.push_back(mine);
+    }
+
+    // whatever no node claimed (or everything, without NUMA information) is one more node
+    std::vector<int> rest;
+    for (int cpu: topo.cpus) {
+        if (topo.cpu_node[cpu] < 0) {
+            topo.cpu_node[cpu] = topo.num_nodes();
+            rest.push_back(cpu);
+        }
+    }
+    if (!rest.empty()) {
+        topo.node_cpus.push_back(rest);
+    }
+    return topo;
+}
+
+int CpuTopology::node_of(int cpu) const {
+    if (cpu < 0 || cpu >= (int) cpu_node.size() || cpu_node[cpu] < 0) {
+        return 0;
+    }
+    return cpu_node[cpu];
+}
+
+int CpuTopology::current_node() const {
+    return node_of(sched_getcpu());
+}
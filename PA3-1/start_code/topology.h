@@ -0,0 +1,32 @@
+#ifndef _TOPOLOGY_H_
+#define _TOPOLOGY_H_
+
+#include <string>
+#include <vector>
+
+// The CPUs this process may run on and the NUMA node of each, read from
+// /sys/devices/system/cpu and /sys/devices/system/node. A machine without NUMA
+// (or without those files) comes out as a single node holding every CPU.
+class CpuTopology {
+public:
+    static CpuTopology discover();
+
+    // Parses a kernel CPU list such as "0-3,8,10-11".
+    static std::vector<int> parse_cpu_list(const std::string &list);
+
+    int num_nodes() const { return (int) node_cpus.size(); }
+
+    // NUMA node of cpu, 0 for a CPU that is not known.
+    int node_of(int cpu) const;
+
+    // NUMA node of the CPU the calling thread is running on right now.
+    int current_node() const;
+
+    std::vector<int> cpus;                    // usable CPUs, in order
+    std::vector<std::vector<int>> node_cpus;  // usable CPUs of each node, empty nodes left out
+
+private:
+    std::vector<int> cpu_node;  // indexed by CPU number
+};
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef _WSDEQUE_H_
+#define _WSDEQUE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Chase-Lev work-stealing deque (the C11 formulation of Le et al., "Correct
+// and Efficient Work-Stealing for Weak Memory Models", PPoPP 2013), for
+// trivially copyable T such as pointers.
+//
+// One owner thread pushes and pops at the bottom, LIFO, so the subtasks it just
+// created run while their data is still in its cache. Any number of thieves
+// take from the top, FIFO, and only the owner and thieves racing for the very
+// last element need a compare-exchange. The array grows when it fills up;
+// replaced arrays are kept until the deque is destroyed, because a thief may
+// still be reading one.
+//
+// The places where the paper uses standalone fences use seq_cst operations
+// instead, which ThreadSanitizer understands.
+template <class T>
+class WorkStealingDeque {
+public:
+    explicit WorkStealingDeque(size_t capacity = 256) {
+        size_t c = 2;
+        while (c < capacity) {
+            c <<= 1;
+        }
+        arrays.emplace_back(new Array(c));
+        array.store(arrays.back().get(), std::memory_order_relaxed);
+    }
+
+    // Owner only.
+    void push(T item) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Array *a = array.load(std::memory_order_relaxed);
+        if (b - t > (int64_t) a->mask) {
+            a = grow(a, t, b);
+        }
+        a->put(b, item);
+        bottom.store(b + 1, std::memory_order_release);
+    }
+
+    // Owner only. Takes the most recently pushed element.
+    bool pop(T &item) {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Array *a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_seq_cst);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);  // was empty
+            return false;
+        }
+        item = a->get(b);
+        if (t == b) {
+            // last element: a thief may be after it too
+            bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // Any thread. Takes the oldest element; fails when the deque is empty or
+    // another thread got to that element first.
+    bool steal(T &item) {
+        int64_t t = top.load(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_seq_cst);
+        if (t >= b) {
+            return false;
+        }
+        Array *a = array.load(std::memory_order_acquire);
+        item = a->get(t);
+        return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    // Approximate when other threads are pushing or popping.
+    bool empty() const {
+        return top.load(std::memory_order_relaxed) >= bottom.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Array {
+        explicit Array(size_t capacity) : mask(capacity - 1), slots(new std::atomic<T>[capacity]) {}
+
+        T get(int64_t i) const { return slots[i & mask].load(std::memory_order_relaxed); }
+        void put(int64_t i, T item) { slots[i & mask].store(item, std::memory_order_relaxed); }
+
+        const size_t mask;
+        std::unique_ptr<std::atomic<T>[]> slots;
+    };
+
+    Array *grow(Array *old, int64_t t, int64_t b) {
+        Array *a = new Array(2 * (old->mask + 1));
+        for (int64_t i = t; i < b; i++) {
+            a->put(i, old->get(i));
+        }
+        arrays.emplace_back(a);
+        array.store(a, std::memory_order_release);
+        return a;
+    }
+
+    alignas(64) std::atomic<int64_t> top{0};
+    alignas(64) std::atomic<int64_t> bottom{0};
+    std::atomic<Array *> array;
+    std::vector<std::unique_ptr<Array>> arrays;  // owner only
+};
+
+#endif